@@ -0,0 +1,183 @@
+// Turns a trajectory file written by troons --trajectory=FILE back into the text troons prints.
+//   decodeTrajectory <trajectory_file>
+// The layout is described next to TrajectoryHeader in Trajectory.h. Build with -DTRAJECTORY_ZSTD -lzstd for files
+// written by a troons built the same way.
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <cstdint>
+#include <cstring>
+#ifdef TRAJECTORY_ZSTD
+#include <zstd.h>
+#endif
+
+#include "Trajectory.h"
+
+using std::string;
+using std::vector;
+
+[[noreturn]] void failTrajectory(const string &message) {
+    std::cerr << message << '\n';
+    std::exit(2);
+}
+
+uint64_t readVarint(const uint8_t *&pos, const uint8_t *end) {
+    uint64_t value = 0;
+    for (int shift = 0; pos < end && shift < 64; shift += 7) {
+        uint8_t byte = *pos++;
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (byte < 0x80) {
+            return value;
+        }
+    }
+    failTrajectory("Truncated trajectory record");
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        std::cerr << argv[0] << " <trajectory_file>\n";
+        std::exit(1);
+    }
+
+    std::ifstream ifs(argv[1], std::ios_base::in | std::ios_base::binary);
+    if (!ifs) {
+        failTrajectory(string("Cannot open ") + argv[1]);
+    }
+    vector<uint8_t> file((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    const uint8_t *pos = file.data();
+    const uint8_t *end = file.data() + file.size();
+
+    TrajectoryHeader header;
+    if (file.size() < sizeof(header)) {
+        failTrajectory("Not a trajectory file");
+    }
+    memcpy(&header, pos, sizeof(header));
+    pos += sizeof(header);
+    if (memcmp(header.magic, TRAJECTORY_MAGIC, 8) != 0 || header.version != TRAJECTORY_VERSION) {
+        failTrajectory("Not a trajectory file of this version");
+    }
+#ifndef TRAJECTORY_ZSTD
+    if (header.flags & TRAJECTORY_COMPRESSED) {
+        failTrajectory("Compressed trajectory, rebuild with -DTRAJECTORY_ZSTD");
+    }
+#endif
+
+    if (static_cast<uint64_t>(end - pos) < header.numLinks * 2 * sizeof(uint32_t) + header.namesSize) {
+        failTrajectory("Truncated trajectory header");
+    }
+    vector<uint32_t> links(header.numLinks * 2);
+    memcpy(links.data(), pos, links.size() * sizeof(uint32_t));
+    pos += links.size() * sizeof(uint32_t);
+
+    vector<string> names;
+    const uint8_t *namesEnd = pos + header.namesSize;
+    while (pos < namesEnd) {
+        const uint8_t *nameEnd = std::find(pos, namesEnd, '\0');
+        names.emplace_back(reinterpret_cast<const char *>(pos), reinterpret_cast<const char *>(nameEnd));
+        pos = nameEnd + 1;
+    }
+    if (names.size() != header.numStations) {
+        failTrajectory("Station names do not match the header");
+    }
+    for (uint32_t station: links) {
+        if (station >= names.size()) {
+            failTrajectory("Link refers to an unknown station");
+        }
+    }
+
+    // the same fragments formatTroon uses
+    vector<string> fragments(3 * header.numLinks);
+    for (size_t l = 0; l < header.numLinks; l++) {
+        const string &source = names[links[2 * l]];
+        const string &destination = names[links[2 * l + 1]];
+        fragments[3 * l + WAITING_AREA] = source + "# ";
+        fragments[3 * l + PLATFORM] = source + "% ";
+        fragments[3 * l + LINK] = source + "->" + destination + " ";
+    }
+
+    vector<uint32_t> states;
+    vector<string> prefixes; // "g12-" of every troon id
+    vector<uint32_t> order; // ids in output order
+    vector<uint8_t> record;
+    string line;
+
+    while (pos < end) {
+        uint64_t recordSize = readVarint(pos, end);
+        const uint8_t *recordPos;
+        const uint8_t *recordEnd;
+#ifdef TRAJECTORY_ZSTD
+        if (header.flags & TRAJECTORY_COMPRESSED) {
+            uint64_t compressedSize = readVarint(pos, end);
+            if (static_cast<uint64_t>(end - pos) < compressedSize) {
+                failTrajectory("Truncated trajectory frame");
+            }
+            record.resize(recordSize);
+            size_t size = ZSTD_decompress(record.data(), record.size(), pos, compressedSize);
+            if (ZSTD_isError(size) || size != recordSize) {
+                failTrajectory("Corrupt trajectory frame");
+            }
+            pos += compressedSize;
+            recordPos = record.data();
+            recordEnd = record.data() + record.size();
+        } else
+#endif
+        {
+            if (static_cast<uint64_t>(end - pos) < recordSize) {
+                failTrajectory("Truncated trajectory frame");
+            }
+            recordPos = pos;
+            recordEnd = pos + recordSize;
+            pos += recordSize;
+        }
+
+        uint64_t tick = readVarint(recordPos, recordEnd);
+
+        uint64_t spawned = readVarint(recordPos, recordEnd);
+        for (uint64_t k = 0; k < spawned; k++) {
+            if (recordPos >= recordEnd || *recordPos > BLUE) {
+                failTrajectory("Corrupt trajectory record");
+            }
+            static const char lineCharacters[] = {'g', 'y', 'b'};
+            char lineCharacter = lineCharacters[*recordPos++];
+            uint32_t id = static_cast<uint32_t>(states.size());
+            states.push_back(static_cast<uint32_t>(readVarint(recordPos, recordEnd)));
+            prefixes.push_back(lineCharacter + std::to_string(id) + "-");
+            order.push_back(id);
+        }
+        if (spawned > 0) {
+            // output order: 'b' < 'g' < 'y', then the ids compared as text, '-' sorts before every digit
+            std::sort(order.begin(), order.end(), [&prefixes](uint32_t a, uint32_t b) {
+                return prefixes[a] < prefixes[b];
+            });
+        }
+
+        uint64_t changed = readVarint(recordPos, recordEnd);
+        uint64_t id = 0;
+        for (uint64_t k = 0; k < changed; k++) {
+            id = k == 0 ? readVarint(recordPos, recordEnd) : id + readVarint(recordPos, recordEnd);
+            if (id >= states.size()) {
+                failTrajectory("Corrupt trajectory record");
+            }
+            states[id] = static_cast<uint32_t>(readVarint(recordPos, recordEnd));
+        }
+
+        line.clear();
+        line += std::to_string(tick);
+        line += ": ";
+        for (uint32_t troon: order) {
+            size_t fragment = 3 * (states[troon] >> 2) + (states[troon] & 3);
+            if (fragment >= fragments.size()) {
+                failTrajectory("Corrupt trajectory record");
+            }
+            line += prefixes[troon];
+            line += fragments[fragment];
+        }
+        line += '\n';
+        std::cout.write(line.data(), static_cast<std::streamsize>(line.size()));
+    }
+
+    return 0;
+}
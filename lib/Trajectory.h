@@ -0,0 +1,35 @@
+// The trajectory format written by troons --trajectory=FILE and read by lib/DecodeTrajectory.cpp.
+#ifndef TROONS_TRAJECTORY_H
+#define TROONS_TRAJECTORY_H
+
+#include <cstdint>
+
+#define WAITING_AREA 0
+#define PLATFORM 1
+#define LINK 2
+
+#define GREEN 0
+#define YELLOW 1
+#define BLUE 2
+
+// Layout of a trajectory file: this header, numLinks (srcId, destId) pairs as uint32_t, the station names each
+// terminated by '\0' and then one frame per printed tick. A frame is the varint length of the record and, if
+// TRAJECTORY_COMPRESSED is set, the varint length of its zstd compression followed by those bytes instead of the
+// record. A record is, all numbers as varints: the tick, the number of troons spawned since the last record followed
+// by their line (one byte) and state, then the number of troons whose state changed followed by their id minus the
+// previous such id (the first one as is) and state. The state of a troon is link << 2 | location, new troons take
+// the ids after the ones already known.
+#define TRAJECTORY_MAGIC "TROONTRJ"
+#define TRAJECTORY_VERSION 1
+#define TRAJECTORY_COMPRESSED 1
+
+struct TrajectoryHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t numStations;
+    uint64_t numLinks;
+    uint64_t namesSize;
+};
+
+#endif
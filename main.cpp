@@ -1,34 +1,112 @@
 #include <mpi.h>
 #include <unistd.h>
-#include <fstream>
 #include <iostream>
 #include <vector>
 #include <queue>
 #include <map>
 #include <algorithm>
-#include <set>
 #include <sstream>
 #include <cstdint>
 #include <climits>
 #include <cstddef>
+#include <functional>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <iomanip>
+#include <fstream>
+#include <cstring>
+#include <charconv>
+#include <string_view>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifdef TRAJECTORY_ZSTD
+#include <zstd.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAS_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#include "lib/Trajectory.h"
 
 using namespace std;
 
-using adjacency_matrix = std::vector<std::vector<size_t>>;
+struct LineEdge { // the distance between two consecutive stations of a line
+    size_t src;
+    size_t dest;
+    size_t distance;
+};
+
+using line_edges = std::vector<LineEdge>; // sorted by (src, dest)
+
+// A link as rank 0 broadcasts it and as a compiled network stores it, the id is the position in the array.
+struct LinkRecord {
+    uint64_t popularity;
+    uint64_t distance;
+    uint32_t nextLinkGreen;
+    uint32_t nextLinkYellow;
+    uint32_t nextLinkBlue;
+    uint32_t srcId;
+    uint32_t destId;
+    uint32_t unused; // explicit padding, so compiled networks are byte for byte reproducible
+};
+
+// Layout of a compiled network (troons --compile): this header, numLinks LinkRecords and then the station names, each
+// terminated by '\0'.
+#define SNAPSHOT_MAGIC "TROONNET"
+#define SNAPSHOT_VERSION 1
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t linkRecordSize; // rejects snapshots written by a build with another layout
+    uint64_t numStations;
+    uint64_t numLinks;
+    uint64_t namesSize;
+    uint64_t ticks;
+    uint64_t numGreenTrains;
+    uint64_t numYellowTrains;
+    uint64_t numBlueTrains;
+    uint64_t numLines;
+    uint64_t terminals[6]; // green, yellow and blue, forward then reverse
+};
 
-#define WAITING_AREA 0
-#define PLATFORM 1
-#define LINK 2
+struct NetworkInput {
+    size_t num_stations;
+    vector<string> station_names;
+    vector<size_t> popularities;
+    line_edges edges;
+    vector<size_t> green_station_ids;
+    vector<size_t> yellow_station_ids;
+    vector<size_t> blue_station_ids;
+    size_t ticks;
+    size_t num_green_trains;
+    size_t num_yellow_trains;
+    size_t num_blue_trains;
+    size_t num_lines;
 
-#define GREEN 0
-#define YELLOW 1
-#define BLUE 2
+    // rank 0 only, the assembled links either in link_storage or in a mapped snapshot
+    const LinkRecord *link_records = nullptr;
+    size_t num_links = 0;
+    vector<LinkRecord> link_storage;
+    void *snapshot_mapping = nullptr;
+    size_t snapshot_length = 0;
+};
 
 // MPI States
 int nprocs; // all processes are equal here
 int myid;
 char hostname[256];
-int linksPerNode;
 
 #define ORIGINAL_PROC 0
 
@@ -46,8 +124,6 @@ int linksPerNode;
 #error "Unknown size_t"
 #endif
 
-#define TROON_ITEMS 7
-MPI_Datatype mpi_troon_type;
 struct Troon {
     size_t arrivalTime = 0;
     size_t id = 0;
@@ -56,8 +132,44 @@ struct Troon {
     size_t location = 0;
     size_t line = 0;
     size_t currentLink = 0;
+    uint64_t sortKey = 0; // output order, see computeTroonSortKey
+};
+
+// Output lines are sorted by their description string, e.g. "g12-changi->tampines ". The description starts with the
+// line character followed by the id digits and a '-', and ids are unique, so the string order is fully decided by
+// (line character, id digits) and the station names / location never take part in it. The key packs the line rank
+// into the top two bits and the id left-aligned to SORT_KEY_DIGITS digits in the rest, with the digit count as a
+// tie-breaker so "g1-" still sorts before "g10-".
+#define SORT_KEY_DIGITS 16
+
+// What goes over the wire when a troon changes rank. src and dest follow from the link, the location is always
+// WAITING_AREA and the sort key follows from id and line. Only the low 32 bits of the arrival tick are sent, the
+// receiver is never more than 2^32 ticks behind it.
+struct TroonHandoff {
+    uint32_t id;
+    uint32_t linkAndLine; // link << 2 | line
+    uint32_t arrivalTick;
 };
 
+// What rank 0 gets for printing, the output only needs the id, line, link and location.
+struct TroonSnapshot {
+    uint32_t id;
+    uint32_t linkLineLocation; // link << 4 | line << 2 | location
+};
+
+#define MAX_LINKS (1U << 28) // the link has to fit in TroonSnapshot
+
+#define TOPOLOGY_HEADER_SIZE 12
+MPI_Datatype mpi_handoff_type;
+MPI_Datatype mpi_snapshot_type;
+
+// Troons live in a per-rank arena and are referred to by their index, freed slots are reused first. Nothing may hold a
+// Troon reference across allocateTroon, the arena can grow.
+typedef uint32_t TroonIndex;
+#define NO_TROON UINT32_MAX
+vector<Troon> troonPool;
+vector<TroonIndex> freeTroons;
+
 struct staticLinkState {
     size_t popularity = 0;
     size_t distance = 0;
@@ -73,7 +185,9 @@ struct staticLinkState {
 };
 
 struct TroonComparison {
-    bool operator()(const Troon *a, const Troon *b) const {
+    bool operator()(TroonIndex x, TroonIndex y) const {
+        const Troon *a = &troonPool[x];
+        const Troon *b = &troonPool[y];
         if (a->arrivalTime == b->arrivalTime) {
             return a->id > b->id;
         } else {
@@ -82,67 +196,376 @@ struct TroonComparison {
     }
 };
 
-class dynamicLinkState { // per node
-public:
-    staticLinkState state;
+// A waiting area, ordered like the former priority queue by arrival tick and then id. Troons enter in order of their
+// arrival tick, so the queue is a vector consumed from head and a new troon only moves past the troons of its own tick
+// with a larger id. A waiting area that never had a troon holds no memory.
+struct ArrivalQueue {
+    vector<TroonIndex> troons;
+    size_t head = 0;
+
+    bool empty() const {
+        return head == troons.size();
+    }
+
+    TroonIndex top() const {
+        return troons[head];
+    }
+
+    // the waiting troons in queue order, without consuming them
+    vector<TroonIndex>::const_iterator begin() const {
+        return troons.begin() + static_cast<std::ptrdiff_t>(head);
+    }
+
+    vector<TroonIndex>::const_iterator end() const {
+        return troons.end();
+    }
+
+    void push(TroonIndex troon) {
+        troons.push_back(troon);
+        size_t i = troons.size() - 1;
+        for (; i > head && TroonComparison()(troons[i - 1], troon); i--) {
+            troons[i] = troons[i - 1];
+        }
+        troons[i] = troon;
+    }
+
+    void pop() {
+        head++;
+        if (head == troons.size()) {
+            troons.clear();
+            head = 0;
+        } else if (head >= 32 && 2 * head >= troons.size()) { // a queue that never drains must not keep growing
+            troons.erase(troons.begin(), troons.begin() + static_cast<std::ptrdiff_t>(head));
+            head = 0;
+        }
+    }
+};
+
+// The per link state, one array per field indexed by link id, so that the per-tick sweeps only stream through the
+// fields they test. distance and popularity are copies of graphState kept next to the counters for the same reason.
+struct dynamicLinkState { // per node
+    vector<size_t> distance;
+    vector<size_t> popularity;
+
+    vector<size_t> platformCounter;
+    vector<size_t> linkCounter;
+    vector<size_t> linkDistance;
+
+    vector<TroonIndex> troonAtPlatform;
+    vector<TroonIndex> troonAtLink;
+
+    vector<ArrivalQueue> waitingArea;
 
-    size_t platformCounter = 0;
-    size_t linkCounter = 0;
-    size_t linkDistance = 0;
+    // event engine only, the counters above are not maintained there
+    vector<size_t> linkArrivalTick; // tick troonAtLink reaches the next waiting area
+    vector<size_t> platformReadyTick; // first tick troonAtPlatform may enter the link
+    vector<size_t> vacatedTick; // last tick a troon left the link, nothing may enter in the same tick
+    vector<uint8_t> isTouched; // waiting area has to be looked at in this tick
+};
+
+// Open addressing tables with linear probing for the lookups while the graph is built, both are kept at most half
+// full and never grow.
+#define EMPTY_SLOT UINT32_MAX
 
-    Troon *troonAtPlatform = nullptr;
-    Troon *troonAtLink = nullptr;
+struct StationNameTable { // station name -> station id
+    vector<uint32_t> slots; // station ids
+    const vector<string> *names;
+};
 
-    priority_queue<Troon *, std::deque<Troon *>, TroonComparison>
-            waitingArea;
+struct LinkTable { // (src, dest) -> link id
+    vector<uint64_t> keys; // src << 32 | dest
+    vector<uint32_t> links;
 };
 
-void convertStationNamesToId(const vector<string> &station_names, vector<size_t> &station_id);
+size_t tableCapacity(size_t entries);
+
+void buildStationNameTable(const vector<string> &names, StationNameTable &table);
+
+size_t findStation(const StationNameTable &table, string_view name);
+
+void initLinkTable(LinkTable &table, size_t maxLinks);
+
+size_t findLink(const LinkTable &table, size_t src, size_t dest);
+
+void insertLink(LinkTable &table, size_t src, size_t dest, size_t link);
+
+void populateStaticData(const vector<size_t> &popularities, const line_edges &edges,
+                        const vector<size_t> &station_id, LinkTable &links);
+
+void assembleLine(const vector<size_t> &station_id, size_t line, const LinkTable &links, bool isReverse);
+
+size_t &lineTerminal(size_t line, bool isForward);
+
+void setNextLinkOnLine(staticLinkState &s, size_t line, size_t next);
+
+size_t lineEdgeDistance(const line_edges &edges, size_t src, size_t dest);
+
+void initialization(const vector<string> &station_names, const vector<size_t> &popularities,
+                    vector<size_t> green_station_id, vector<size_t> yellow_station_id,
+                    vector<size_t> blue_station_id, const line_edges &edges);
+
+void processLinks(size_t tick);
+
+void moveTroonToNextLink(size_t link, size_t tick);
+
+void pushToWaitingArea(size_t link, TroonIndex troon);
+
+TroonIndex allocateTroon(const Troon &troon);
+
+void releaseTroon(TroonIndex index);
+
+void processPushPlatform(size_t link, size_t tick);
+
+void announceDeparture(size_t link, size_t arrivalTick);
+
+void announceInFlightTroons(size_t firstTick);
+
+void deliverPendingArrivals(size_t tick);
+
+bool isLookaheadWindowEnd(size_t firstTick, size_t t);
 
-void populateStaticData(const vector<size_t> &popularities, const adjacency_matrix &mat,
-                        const vector<size_t> &station_id, map<pair<size_t, size_t>, size_t> &tempLinkMapping);
+void computeLookahead();
 
-void assembleGreenLine(const vector<size_t> &green_station_id, map<pair<size_t, size_t>, size_t> &tempLinkMapping,
-                       bool isReverse);
+void processWaitingArea(size_t link);
 
-void assembleYellowLine(const vector<size_t> &yellow_station_id, map<pair<size_t, size_t>, size_t> &tempLinkMapping,
-                        bool isReverse);
+void processWaitPlatforms();
 
-void assembleBlueLine(const vector<size_t> &blue_station_id, map<pair<size_t, size_t>, size_t> &tempLinkMapping,
-                      bool isReverse);
+void processPushPlatforms(size_t tick);
 
-void initialization(size_t num_stations, const vector<string> &station_names, const vector<size_t> &popularities,
-                    const vector<string> &green_station_names, const vector<string> &yellow_station_names,
-                    const vector<string> &blue_station_names, const adjacency_matrix &mat);
+void processWaitingAreas();
 
-void processLink(dynamicLinkState *dstate, size_t tick);
+template<typename Phase>
+void runThreadPhase(Phase phase);
 
-void processPushPlatform(dynamicLinkState *dstate);
+int takeChunk(int thread);
 
-void processWaitingArea(dynamicLinkState *dstate);
+void resetChunks();
 
-void processWaitPlatform(dynamicLinkState *dstate);
+void adaptChunks();
+
+vector<int> &phaseSlowLinks();
+
+void mergeThreadBuffers();
 
 string generateTroonDescription(const Troon &t);
 
+void buildOutputFragments();
+
+char *formatTroon(char *out, const Troon &t);
+
+char *reserveOutput(size_t used, size_t troons);
+
+void runFormatBenchmark();
+
+uint64_t computeTroonSortKey(size_t id, size_t line);
+
 void spawnTroons(size_t num_green_trains, size_t num_yellow_trains, size_t num_blue_trains, size_t t);
 
 void printTroons(size_t ticks, size_t num_lines, size_t t);
 
+void writeTroons(size_t t);
+
+struct OutputSlot;
+
+OutputSlot &acquireOutputSlot();
+
+void publishOutputSlot();
+
+void writeOutputSlot(const OutputSlot &slot);
+
+void runWriter();
+
+void openTrajectory();
+
+void writeTrajectorySlot(const OutputSlot &slot);
+
+void appendVarint(vector<uint8_t> &bytes, uint64_t value);
+
+void startWriter();
+
+void stopWriter();
+
+void failOutput(const string &message);
+
+void checkOutputError();
+
+void countSpawnedTroon(size_t line);
+
 void clean();
 
-void createMpiTroonType();
+void createMpiTypes();
+
+void broadcastTopology(NetworkInput &input);
+
+TroonHandoff packHandoff(const Troon &troon);
+
+Troon unpackHandoff(const TroonHandoff &handoff, size_t tick);
+
+TroonSnapshot packSnapshot(const Troon &troon);
+
+Troon unpackSnapshot(const TroonSnapshot &snapshot);
 
 void exchangeTroons(size_t tick);
 
+void createNeighborhood();
+
+void exchangeTroonsOverlapped(size_t tick);
+
+void createOverlapRequests();
+
+void runTickBenchmark();
+
+void runKernelBenchmark();
+
+bool selectSweepKernels(const string &name);
+
+void runSweepEngine(size_t firstTick, size_t ticks, size_t num_green_trains, size_t num_yellow_trains,
+                    size_t num_blue_trains, size_t num_lines);
+
+void runEventEngine(size_t firstTick, size_t ticks, size_t num_green_trains, size_t num_yellow_trains,
+                    size_t num_blue_trains, size_t num_lines);
+
+void processEventTick(size_t t, size_t num_green_trains, size_t num_yellow_trains, size_t num_blue_trains);
+
+size_t fastForward(size_t ticks, size_t num_green_trains, size_t num_yellow_trains, size_t num_blue_trains,
+                   size_t num_lines);
+
+void initializeCalendars(size_t firstTick);
+
+size_t nextEventTick(size_t tick, size_t limit);
+
+void convertEventStateToSweep(size_t lastTick);
+
+void partitionLinks(size_t num_green_trains, size_t num_yellow_trains, size_t num_blue_trains);
+
+void partitionLinksByBlock();
+
+void rebalanceLinks(size_t tick);
+
+void migrateLinks(const vector<int> &newStart, size_t tick);
+
+void reportRebalancing();
+
+void profileStart();
+
+void profilePhase(int phase);
+
+void reportProfile();
+
+template<typename Step>
+void forEachLineStep(Step step);
+
+size_t nextLinkOnLine(const staticLinkState &s, size_t line);
+
+void scheduleEvent(vector<vector<size_t>> &calendar, size_t tick, size_t link);
+
+void processArrivalEvents(size_t tick);
+
+void processDepartureEvents(size_t tick);
+
+void processTouchedLinks(size_t tick);
+
 // mapping
-map<string, uint32_t> stationNameIdMapping;
 vector<string> stationIdNameMapping;
 
 // link states
 size_t graphCounter = 0;
 vector<staticLinkState> graphState;
-vector<dynamicLinkState *> graphStateDynamic; // to be initialized in each node
+dynamicLinkState graphStateDynamic; // to be initialized in each node
+
+struct SweepKernels {
+    const char *name;
+    void (*updateLinks)(int begin, int end, vector<int> &slow);
+    void (*findDepartures)(int begin, int end, vector<int> &slow);
+    void (*countPlatforms)(int begin, int end);
+};
+
+const SweepKernels *sweepKernels;
+vector<int> slowLinks; // links the current kernel handed to the slow path
+#define BENCH_KERNEL_LINKS (1 << 16)
+
+// hybrid mode (--threads=N): the sweep phases split [startLink, endLink) into chunks that the threads take from
+// each other, see runThreadPhase. Inside a phase a thread only writes the links of the chunks it runs, whatever
+// reaches other links or shared buffers is collected in its ThreadBuffers and applied by mergeThreadBuffers once the
+// phase is over
+struct ThreadBuffers {
+    vector<int> slowLinks;
+    vector<TroonIndex> arrivals; // troons moved into a local waiting area, the troon's currentLink says which one
+    vector<TroonIndex> released;
+    vector<vector<TroonHandoff>> handoffs; // indexed by rank, like troons_buffer_to_send
+};
+
+int numThreads = 1;
+vector<ThreadBuffers> threadBuffers;
+
+ThreadBuffers *currentThreadBuffers();
+
+// Chunk c is [chunkStart[c], chunkStart[c + 1]). Every tick the chunks are recut so that each takes about the same
+// time by the cost measured for the previous tick, so the few busy links near the terminals end up in small chunks.
+#define CHUNKS_PER_THREAD 8
+#define MIN_CHUNK_LINKS 64
+vector<int> chunkStart;
+vector<double> chunkCost; // seconds spent in the chunk since the last adaptChunks
+
+// the chunks [next, end) a thread has left, packed as next << 32 | end so that the owner taking from the front and a
+// thief taking from the back agree with a single compare-and-swap
+struct alignas(64) ChunkQueue {
+    std::atomic<uint64_t> range;
+};
+vector<ChunkQueue> chunkQueues;
+
+// printTroons buffers, kept across the printed ticks
+vector<Troon> printedTroons;
+vector<TroonSnapshot> printedSnapshots;
+
+// --output=<file>: instead of rank 0 printing everything, every rank formats a slice of the sorted troons and the
+// slices are written to the file with MPI-IO, see writeTroons
+string outputPath;
+MPI_File outputFile;
+MPI_Offset outputOffset = 0;
+vector<uint64_t> spawnedSortKeys; // of every troon spawned so far, sorted up to sortedKeyCount
+size_t sortedKeyCount = 0;
+vector<Troon> sliceTroons;
+vector<TroonSnapshot> sliceSnapshots;
+
+// formatTroon copies the location part of a description from these fragments, "src# ", "src% " and "src->dest " of
+// link l being fragment 3 * l + location, built once the links are numbered
+vector<char> fragmentText;
+vector<uint32_t> fragmentOffset; // fragment f is [fragmentOffset[f], fragmentOffset[f + 1]) of fragmentText
+size_t maxDescriptionLength = 0;
+vector<char> outputBuffer; // the formatted line of a tick
+#define BENCH_FORMAT_TROONS (1 << 16)
+
+// Rank 0 hands every printed tick to writerThread in one of two slots: the simulation receives the next tick into one
+// while the writer merges, formats and writes the other, and waits once both are taken. With --writer=inline
+// printTroons writes the slot itself.
+struct OutputSlot {
+    size_t tick = 0;
+    vector<int> counts; // troons per rank, their sorted runs follow each other in snapshots
+    vector<TroonSnapshot> snapshots;
+};
+
+#define OUTPUT_SLOTS 2
+bool useWriterThread = true;
+std::thread writerThread;
+std::mutex outputMutex;
+std::condition_variable outputChanged;
+OutputSlot outputSlots[OUTPUT_SLOTS];
+size_t filledSlots = 0; // handed to the writer so far
+size_t writtenSlots = 0; // written by the writer so far
+bool isOutputClosed = false;
+string outputError; // set by whichever thread writes, reported by the main thread so that it can abort all ranks
+
+// --trajectory=FILE: the writer stores the printed ticks as binary records instead of text, see TrajectoryHeader
+string trajectoryPath;
+std::ofstream trajectoryFile;
+vector<uint32_t> trajectoryStates; // state of every troon id as of the last record
+vector<uint32_t> tickStates;
+vector<uint8_t> tickLines;
+vector<uint8_t> trajectoryRecord;
+vector<uint8_t> trajectoryChanges;
+vector<uint8_t> trajectoryFrame;
+vector<uint8_t> trajectoryCompressed; // grows to the largest compressed record and is kept
 
 size_t terminalGreenForward;
 size_t terminalGreenReverse;
@@ -157,117 +580,232 @@ size_t blueTroonCounter = 0;
 size_t yellowTroonCounter = 0;
 size_t troonIdCounter = 0;
 
-struct TroonLexicographyComparison {
-    bool operator()(const Troon *a, const Troon *b) const {
-        return generateTroonDescription(*a) < generateTroonDescription(*b);
+struct TroonSortKeyComparison {
+    bool operator()(const Troon &a, const Troon &b) const {
+        return a.sortKey < b.sortKey;
     }
 };
 
+// engine state
+bool useEventEngine = false;
+bool useFastForward = false;
+bool isTrackingTouchedLinks = false; // set while the event engine runs
+
+// lookahead mode: a troon handed to another rank is announced when it enters the link, stamped with its arrival tick,
+// and ranks only exchange every `lookahead` ticks, see computeLookahead
+bool useLookahead = false;
+size_t lookahead = 1;
+map<size_t, vector<TroonIndex>> pendingArrivals; // received troons by arrival tick
+
+// event engine calendars, a ring of per-tick link lists indexed by tick % calendarSize
+size_t calendarSize;
+vector<vector<size_t>> arrivalCalendar;
+vector<vector<size_t>> departureCalendar;
+vector<size_t> dueEvents;
+vector<size_t> touchedLinks;
+
+// partition state, rank r owns the links [partitionStart[r], partitionStart[r + 1])
+bool useBlockPartition = false;
+vector<int> partitionStart;
+vector<int> linkOwner;
+
+// rebalancing (--rebalance=N): every N ticks the ranks share how many troons each link holds and, if the busiest rank
+// carries more than rebalanceThreshold percent over the average, shift the range boundaries and move the link state
+size_t rebalanceInterval = 0;
+size_t rebalanceThreshold = 10;
+size_t rebalanceCount = 0;
+size_t migratedLinks = 0;
+size_t migratedTroons = 0;
+double rebalanceSeconds = 0;
+
+// --profile: every rank adds the time since the previous mark to the phase that just ended, reportProfile reduces the
+// totals over the ranks
+#define PHASE_SETUP 0
+#define PHASE_LINKS 1
+#define PHASE_EXCHANGE 2
+#define PHASE_DEPARTURES 3
+#define PHASE_SPAWN 4
+#define PHASE_WAITING_AREAS 5
+#define PHASE_PLATFORMS 6
+#define PHASE_PRINT 7
+#define PHASE_REBALANCE 8
+#define NUM_PHASES 9
+const char *phaseNames[NUM_PHASES] = {"setup", "links", "exchange", "departures", "spawn", "waiting areas",
+                                      "platforms", "print", "rebalance"};
+bool useProfile = false;
+double phaseSeconds[NUM_PHASES];
+std::chrono::steady_clock::time_point lastPhaseMark;
+
+// a migrated link, followed in the troon buffer by its platform troon, its link troon and its waiting area in order
+struct LinkMigration {
+    uint64_t platformCounter;
+    uint64_t linkCounter;
+    uint64_t linkDistance;
+    uint32_t link;
+    uint32_t numWaiting;
+    uint32_t hasPlatformTroon;
+    uint32_t hasLinkTroon;
+};
+
 // comm state
 int startLink, endLink;
-vector<vector<Troon>> troons_buffer_to_send;
-int *troons_counter;
-int *troons_counter_recv_buffer;
-MPI_Request *req;
-
-void simulate(
-        size_t num_stations,
-        const vector<string> &station_names,
-        const std::vector<size_t> &popularities,
-        const adjacency_matrix &mat,
-        const vector<string> &green_station_names,
-        const vector<string> &yellow_station_names,
-        const vector<string> &blue_station_names, size_t ticks,
-        size_t num_green_trains, size_t num_yellow_trains,
-        size_t num_blue_trains, size_t num_lines,
-        int argc,
-        char **argv
-) {
-
-    // Initialization
-    initialization(
-            num_stations,
-            station_names,
-            popularities,
-            green_station_names,
-            yellow_station_names,
-            blue_station_names,
-            mat
-    );
-
-#ifdef DEBUG
-    for (auto &c: graphState) {
-        cout << c.id << " " << c.srcId << " " << c.destId << " Y : " << c.nextLinkYellow << " G : " << c.nextLinkGreen
-             << "  B : " << c.nextLinkBlue << " Distance: " << c.distance << endl;
-    }
-    cout << terminalGreenForward << " " << terminalGreenReverse << endl;
-    cout << terminalYellowForward << " " << terminalYellowReverse << endl;
-    cout << terminalBlueForward << " " << terminalBlueReverse << endl;
-#endif
-
-    MPI_Init(&argc, &argv);
-    MPI_Comm_size(MPI_COMM_WORLD, &nprocs);
-    MPI_Comm_rank(MPI_COMM_WORLD, &myid);
-
-    troons_counter_recv_buffer = new int[nprocs];
-    troons_counter = new int[nprocs];
-    req = new MPI_Request[nprocs * 2];
-
+vector<vector<TroonHandoff>> troons_buffer_to_send; // indexed by rank, only neighbours are ever filled
+
+// ranks this one hands troons to (out) and receives troons from (in), see createNeighborhood
+MPI_Comm neighborComm;
+vector<int> outNeighbors;
+vector<int> inNeighbors;
+vector<int> troons_counter;
+vector<int> troons_counter_recv_buffer;
+vector<int> send_displacements;
+vector<int> recv_displacements;
+vector<TroonHandoff> troons_send_buffer;
+vector<TroonHandoff> troons_recv_buffer;
+
+// overlap mode: a receive per in-neighbour stays posted between ticks, sized for the most troons that neighbour can
+// hand over in one tick, so no counts have to be exchanged first
+bool useOverlap = false;
+vector<vector<TroonHandoff>> overlap_recv_buffers;
+vector<MPI_Request> overlap_recv_requests;
+vector<MPI_Request> overlap_send_requests;
+string benchmark;
+
+void simulate(size_t ticks, size_t num_green_trains, size_t num_yellow_trains, size_t num_blue_trains,
+              size_t num_lines) {
     troons_buffer_to_send.reserve(nprocs);
     for (int i = 0; i < nprocs; i++) {
-        vector<Troon> b;
+        vector<TroonHandoff> b;
         troons_buffer_to_send.push_back(b);
     }
 
+    if (numThreads > 1) {
+        threadBuffers.resize(numThreads);
+        for (ThreadBuffers &buffers: threadBuffers) {
+            buffers.handoffs.resize(nprocs);
+        }
+        chunkQueues = vector<ChunkQueue>(numThreads);
+    }
+
     int sc_status = gethostname(hostname, sizeof(hostname) - 1);
     if (sc_status) {
         perror("gethostname fails");
         MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
     }
 
-    createMpiTroonType();
+    createMpiTypes();
 
-    // initialize per node
-    for (size_t i = 0; i < graphState.size(); i++) {
-        auto *d = new dynamicLinkState();
-        d->state = graphState[i];
+    if (!outputPath.empty()) {
+        int status = MPI_File_open(MPI_COMM_WORLD, outputPath.c_str(), MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                                   MPI_INFO_NULL, &outputFile);
+        if (status != MPI_SUCCESS) {
+            if (myid == ORIGINAL_PROC) {
+                std::cerr << "Cannot open " << outputPath << '\n';
+            }
+            MPI_Abort(MPI_COMM_WORLD, 2);
+        }
+        MPI_File_set_size(outputFile, 0);
+    }
+
+    // a rank can at most hold every troon, so the arena never has to grow during the run
+    troonPool.reserve(num_green_trains + num_yellow_trains + num_blue_trains);
+
+    if (useBlockPartition) {
+        partitionLinksByBlock();
+    } else {
+        partitionLinks(num_green_trains, num_yellow_trains, num_blue_trains);
+    }
+
+    // only the ranks that format troons have the station names, see broadcastTopology
+    if (!stationIdNameMapping.empty()) {
+        buildOutputFragments();
+    }
+
+    if (myid == ORIGINAL_PROC && !trajectoryPath.empty() && benchmark.empty()) {
+        openTrajectory();
+    }
 
-        graphStateDynamic.push_back(d);
+    useWriterThread = useWriterThread && myid == ORIGINAL_PROC && outputPath.empty() && benchmark.empty();
+    if (useWriterThread) {
+        startWriter();
     }
 
-    linksPerNode = (static_cast<int>(graphState.size()) + nprocs - 1) / nprocs;
+    // initialize per node
+    size_t numLinks = graphState.size();
+    dynamicLinkState &d = graphStateDynamic;
+    d.distance.resize(numLinks);
+    d.popularity.resize(numLinks);
+    for (size_t i = 0; i < numLinks; i++) {
+        d.distance[i] = graphState[i].distance;
+        d.popularity[i] = graphState[i].popularity;
+    }
+    d.platformCounter.assign(numLinks, 0);
+    d.linkCounter.assign(numLinks, 0);
+    d.linkDistance.assign(numLinks, 0);
+    d.troonAtPlatform.assign(numLinks, NO_TROON);
+    d.troonAtLink.assign(numLinks, NO_TROON);
+    d.waitingArea.resize(numLinks);
+    d.linkArrivalTick.assign(numLinks, 0);
+    d.platformReadyTick.assign(numLinks, 0);
+    d.vacatedTick.assign(numLinks, SIZE_MAX);
+    d.isTouched.assign(numLinks, 0);
 
     // for each node
-    startLink = myid * linksPerNode;
-    endLink = min(static_cast<int>(graphStateDynamic.size()), (myid + 1) * linksPerNode);
+    startLink = partitionStart[myid];
+    endLink = partitionStart[myid + 1];
+
+    createNeighborhood();
+    if (useLookahead) {
+        computeLookahead();
+    }
+    if (useOverlap || benchmark == "tick") {
+        createOverlapRequests();
+    }
 
 #ifdef DEBUG
     cout << myid << " handles " << startLink << " -> " << endLink - 1 << endl;
 #endif
 
-    for (size_t t = 0; t < ticks; t++) {
-        for (int i = startLink; i < endLink; i++) {
-            processLink(graphStateDynamic[i], t);
-        }
+    if (benchmark == "tick") {
+        runTickBenchmark();
+        clean();
+        MPI_Finalize();
+        return;
+    }
 
-        MPI_Barrier(MPI_COMM_WORLD);
-        exchangeTroons(t);
+    if (benchmark == "format") {
+        runFormatBenchmark();
+        clean();
+        MPI_Finalize();
+        return;
+    }
 
-        for (int i = startLink; i < endLink; i++) {
-            processPushPlatform(graphStateDynamic[i]);
-        }
+    if (benchmark == "kernels") {
+        runKernelBenchmark();
+        clean();
+        MPI_Finalize();
+        return;
+    }
 
-        spawnTroons(num_green_trains, num_yellow_trains, num_blue_trains, t);
+    profileStart();
+    size_t firstTick = 0;
+    if (useFastForward) {
+        firstTick = fastForward(ticks, num_green_trains, num_yellow_trains, num_blue_trains, num_lines);
+    }
 
-        // for each node
-        for (int i = startLink; i < endLink; i++) {
-            processWaitingArea(graphStateDynamic[i]);
-            processWaitPlatform(graphStateDynamic[i]);
+    if (useEventEngine) {
+        runEventEngine(firstTick, ticks, num_green_trains, num_yellow_trains, num_blue_trains, num_lines);
+    } else {
+        if (firstTick > 0) {
+            convertEventStateToSweep(firstTick - 1);
         }
+        runSweepEngine(firstTick, ticks, num_green_trains, num_yellow_trains, num_blue_trains, num_lines);
+        if (rebalanceInterval > 0) {
+            reportRebalancing();
+        }
+    }
 
-        // master only
-        MPI_Barrier(MPI_COMM_WORLD);
-        printTroons(ticks, num_lines, t);
+    if (useProfile) {
+        reportProfile();
     }
 
     // for each node
@@ -276,185 +814,1013 @@ void simulate(
     MPI_Finalize();
 }
 
-void exchangeTroons(size_t tick) {
-    for (int j = 0; j < nprocs; j++) {
-        troons_counter[j] = static_cast<int>(troons_buffer_to_send[j].size());
+void runSweepEngine(size_t firstTick, size_t ticks, size_t num_green_trains, size_t num_yellow_trains,
+                    size_t num_blue_trains, size_t num_lines) {
+    if (useLookahead) {
+        announceInFlightTroons(firstTick);
     }
 
-    MPI_Alltoall(troons_counter, 1, MPI_INT, troons_counter_recv_buffer, 1, MPI_INT, MPI_COMM_WORLD);
-
-#ifdef DEBUG
-    if (tick >= 24) { // Change to check which tick to observe
-        for (int j = 0; j < nprocs; j++) {
-            cout << j  << " -> " << myid << " at " << tick << " : " << troons_counter_recv_buffer[j] << endl;
-        }
+    if (numThreads > 1) {
+        resetChunks();
     }
-#endif
+    profilePhase(PHASE_SETUP);
 
-    auto **troons_recv_buffer = new Troon *[nprocs];
-
-    for (int i = 0; i < nprocs; i++) {
-        int toSendSize = static_cast<int>(troons_buffer_to_send[i].size());
-        Troon *buffer_send = &troons_buffer_to_send[i][0];
+    for (size_t t = firstTick; t < ticks; t++) {
+        if (numThreads > 1) {
+            adaptChunks();
+        }
+        processLinks(t);
+        profilePhase(PHASE_LINKS);
 
-#ifdef DEBUG
-        if (toSendSize > 0) {
-            cout << tick << " | " << myid << " sending to " << i << " " << toSendSize << " troons" << endl;
+        if (useLookahead) {
+            deliverPendingArrivals(t);
+        } else {
+            exchangeTroons(t);
         }
-#endif
+        profilePhase(PHASE_EXCHANGE);
 
-        MPI_Isend(buffer_send, toSendSize, mpi_troon_type, i, 0, MPI_COMM_WORLD, &req[i * 2]);
+        processPushPlatforms(t);
+        profilePhase(PHASE_DEPARTURES);
 
-        int toReceiveSize = troons_counter_recv_buffer[i];
-        auto troon_buffer = new Troon[toReceiveSize];
-        troons_recv_buffer[i] = troon_buffer;
-        MPI_Irecv(troon_buffer, toReceiveSize, mpi_troon_type, i, 0, MPI_COMM_WORLD, &req[i * 2 + 1]);
-    }
+        spawnTroons(num_green_trains, num_yellow_trains, num_blue_trains, t);
+        profilePhase(PHASE_SPAWN);
 
-    MPI_Waitall(nprocs * 2, req, MPI_STATUS_IGNORE);
+        // for each node
+        processWaitingAreas();
+        profilePhase(PHASE_WAITING_AREAS);
+        processWaitPlatforms();
+        profilePhase(PHASE_PLATFORMS);
 
-    for (auto &c: troons_buffer_to_send) {
-        c.clear();
-    }
+        // master only
+        printTroons(ticks, num_lines, t);
+        profilePhase(PHASE_PRINT);
 
-    // insert all the troons
-    size_t desiredLink;
-    for (int i = 0; i < nprocs; i++) {
-        if (i == myid) continue;
-        for (int j = 0; j < troons_counter_recv_buffer[i]; j++) {
-            Troon *t = &troons_recv_buffer[i][j];
-            desiredLink = t->currentLink;
-#ifdef DEBUG
-            cout << tick << " | Id: " << myid << " receive troon: " << generateTroonDescription(*t) << desiredLink
-                 << endl;
-#endif
-            graphStateDynamic[desiredLink]->waitingArea.push(t);
+        if (rebalanceInterval > 0 && (t + 1) % rebalanceInterval == 0 && t + 1 < ticks) {
+            rebalanceLinks(t);
+            profilePhase(PHASE_REBALANCE);
         }
-    }
 
-    delete[] troons_recv_buffer;
+        if (useLookahead && isLookaheadWindowEnd(firstTick, t)) {
+            exchangeTroons(t);
+            profilePhase(PHASE_EXCHANGE);
+        }
+    }
 }
 
-void createMpiTroonType() {
-    int troon_blocklengths[TROON_ITEMS] = {1, 1, 1, 1, 1, 1, 1};
-    MPI_Datatype troon_types[TROON_ITEMS] = {MPI_SIZE_T, MPI_SIZE_T, MPI_SIZE_T, MPI_SIZE_T, MPI_SIZE_T, MPI_SIZE_T,
-                                             MPI_SIZE_T};
-    MPI_Aint troon_offsets[TROON_ITEMS];
-
-    troon_offsets[0] = offsetof(Troon, arrivalTime);
-    troon_offsets[1] = offsetof(Troon, id);
-    troon_offsets[2] = offsetof(Troon, src);
-    troon_offsets[3] = offsetof(Troon, dest);
-    troon_offsets[4] = offsetof(Troon, location);
-    troon_offsets[5] = offsetof(Troon, line);
-    troon_offsets[6] = offsetof(Troon, currentLink);
+// Event-driven variant of runSweepEngine. Instead of visiting every link three times per tick, a link is only looked
+// at when something can change there: a troon on the link arriving at the next waiting area (tick + distance), the
+// troon on the platform becoming ready to leave (boarding tick + popularity + 2) or the link it waits on freeing up,
+// and a waiting area receiving a troon while its platform is free. Both calendars only ever hold ticks less than
+// calendarSize ahead, so a ring of buckets is enough. Output is identical to the sweep.
+void runEventEngine(size_t firstTick, size_t ticks, size_t num_green_trains, size_t num_yellow_trains,
+                    size_t num_blue_trains, size_t num_lines) {
+    isTrackingTouchedLinks = true;
+    initializeCalendars(firstTick);
+
+    if (useLookahead) {
+        announceInFlightTroons(firstTick);
+    }
+    profilePhase(PHASE_SETUP);
 
-    MPI_Type_create_struct(TROON_ITEMS, troon_blocklengths, troon_offsets, troon_types, &mpi_troon_type);
-    MPI_Type_commit(&mpi_troon_type);
-}
+    for (size_t t = firstTick; t < ticks; t++) {
+        processEventTick(t, num_green_trains, num_yellow_trains, num_blue_trains);
 
-void clean() {
-    for (auto c: graphStateDynamic) {
-        delete c->troonAtPlatform;
-        delete c->troonAtLink;
+        printTroons(ticks, num_lines, t);
+        profilePhase(PHASE_PRINT);
 
-        while (!c->waitingArea.empty()) {
-            Troon *troon = c->waitingArea.top();
-            delete troon;
-            c->waitingArea.pop();
+        if (useLookahead && isLookaheadWindowEnd(firstTick, t)) {
+            exchangeTroons(t);
+            profilePhase(PHASE_EXCHANGE);
         }
-
-        delete c;
     }
-
-    delete[] troons_counter_recv_buffer;
-    delete[] troons_counter;
-    delete[] req;
 }
 
-void printTroons(size_t ticks, size_t num_lines, size_t t) {
-    if (ticks - t > num_lines) return;
+void processEventTick(size_t t, size_t num_green_trains, size_t num_yellow_trains, size_t num_blue_trains) {
+    processArrivalEvents(t);
+    profilePhase(PHASE_LINKS);
 
-    vector<Troon> troon_vector;
+    if (useLookahead) {
+        deliverPendingArrivals(t);
+    } else {
+        exchangeTroons(t);
+    }
+    profilePhase(PHASE_EXCHANGE);
 
-    for (int i = startLink; i < endLink; i++) {
-        if (graphStateDynamic[i]->troonAtLink != nullptr) {
-            troon_vector.push_back(*graphStateDynamic[i]->troonAtLink);
-        }
+    processDepartureEvents(t);
+    profilePhase(PHASE_DEPARTURES);
 
-        if (graphStateDynamic[i]->troonAtPlatform != nullptr) {
-            troon_vector.push_back(*graphStateDynamic[i]->troonAtPlatform);
+    spawnTroons(num_green_trains, num_yellow_trains, num_blue_trains, t);
+    size_t terminals[] = {terminalGreenForward, terminalGreenReverse, terminalYellowForward, terminalYellowReverse,
+                          terminalBlueForward, terminalBlueReverse};
+    for (size_t terminal: terminals) {
+        if (startLink <= static_cast<int>(terminal) && static_cast<int>(terminal) < endLink) {
+            pushToWaitingArea(terminal, NO_TROON);
         }
+    }
+    profilePhase(PHASE_SPAWN);
 
-        priority_queue<Troon *, std::deque<Troon *>, TroonComparison> new_pq;
+    processTouchedLinks(t);
+    profilePhase(PHASE_WAITING_AREAS);
+}
 
-        while (!graphStateDynamic[i]->waitingArea.empty()) {
-            Troon *troon = graphStateDynamic[i]->waitingArea.top();
-            new_pq.push(troon);
-            troon_vector.push_back(*troon);
-            graphStateDynamic[i]->waitingArea.pop();
+// Ticks before ticks - num_lines are never printed. Every rank runs them over its own links with the event engine and
+// the troons that change rank are sent ahead as in lookahead mode, so the ranks only exchange once per window of
+// `lookahead` ticks. Once all troons are spawned a rank jumps to its next event within the window, and the windows in
+// which no rank has an event are skipped. See the README for when this pays off.
+// Returns the first tick that still has to be simulated.
+size_t fastForward(size_t ticks, size_t num_green_trains, size_t num_yellow_trains, size_t num_blue_trains,
+                   size_t num_lines) {
+    size_t silentTicks = ticks > num_lines ? ticks - num_lines : 0;
+    if (silentTicks == 0) return 0;
+
+    // the prefix always exchanges per window with counts, whatever the printed ticks use
+    bool wasLookahead = useLookahead;
+    bool wasOverlap = useOverlap;
+    if (!useLookahead) {
+        computeLookahead();
+    }
+    useLookahead = true;
+    useOverlap = false;
+
+    isTrackingTouchedLinks = true;
+    initializeCalendars(0);
+
+    auto isSpawning = [&]() {
+        return greenTroonCounter < num_green_trains || yellowTroonCounter < num_yellow_trains ||
+               blueTroonCounter < num_blue_trains;
+    };
+
+    size_t windowStart = 0;
+    while (windowStart < silentTicks) {
+        size_t windowEnd = silentTicks - windowStart > lookahead ? windowStart + lookahead : silentTicks;
+        for (size_t t = windowStart; t < windowEnd; t++) {
+            if (!isSpawning()) {
+                t = nextEventTick(t, windowEnd);
+                if (t == windowEnd) break;
+            }
+            processEventTick(t, num_green_trains, num_yellow_trains, num_blue_trains);
         }
+        if (windowEnd == silentTicks) break;
 
-        graphStateDynamic[i]->waitingArea = new_pq;
-    }
+        exchangeTroons(windowEnd - 1);
+        profilePhase(PHASE_EXCHANGE);
+        windowStart = windowEnd;
 
-#ifdef DEBUG
-    stringstream ss;
-    ss << myid << " -> " << t << ": ";
-    for (auto &troon: troon_vector) {
-        ss << generateTroonDescription(troon);
+        if (!isSpawning()) {
+            unsigned long long localNext = nextEventTick(windowStart, silentTicks);
+            unsigned long long globalNext;
+            MPI_Allreduce(&localNext, &globalNext, 1, MPI_UNSIGNED_LONG_LONG, MPI_MIN, MPI_COMM_WORLD);
+            windowStart = globalNext - globalNext % lookahead; // stays on the window grid
+        }
     }
 
-    cout << ss.str() << endl;
-    return;
-#endif
-
-    int troon_to_be_received = static_cast<int>(troon_vector.size());
-    if (myid == ORIGINAL_PROC) {
-        set<Troon *, TroonLexicographyComparison> troons;
+    // the troons still on a link were announced to the rank they go to next, the engine that takes over announces or
+    // sends them again itself
+    for (auto &arrivals: pendingArrivals) {
+        for (TroonIndex troon: arrivals.second) {
+            releaseTroon(troon);
+        }
+    }
+    pendingArrivals.clear();
+    for (vector<TroonHandoff> &buffer: troons_buffer_to_send) {
+        buffer.clear();
+    }
 
-        int *troons_counters = new int[nprocs];
-        MPI_Gather(&troon_to_be_received, 1, MPI_INT, troons_counters, 1, MPI_INT, ORIGINAL_PROC, MPI_COMM_WORLD);
+    useLookahead = wasLookahead;
+    useOverlap = wasOverlap;
+    isTrackingTouchedLinks = false;
 
-        auto **troons_recv_buffer = new Troon *[nprocs];
+    return silentTicks;
+}
 
-        for (int i = 0; i < nprocs; i++) {
-            if (i == ORIGINAL_PROC) continue;
+// (Re)builds the calendars from the link states, for a run starting at firstTick.
+void initializeCalendars(size_t firstTick) {
+    dynamicLinkState &d = graphStateDynamic;
+    calendarSize = 2;
+    for (int i = startLink; i < endLink; i++) {
+        calendarSize = max(calendarSize, max(d.distance[i], d.popularity[i] + 2) + 2);
+    }
 
-            auto troon_buffer = new Troon[troons_counters[i]];
-            troons_recv_buffer[i] = troon_buffer;
+    arrivalCalendar.assign(calendarSize, vector<size_t>());
+    departureCalendar.assign(calendarSize, vector<size_t>());
 
-            MPI_Recv(troon_buffer, troons_counters[i], mpi_troon_type, i, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-            for (int j = 0; j < troons_counters[i]; j++) {
-                troons.insert(&troon_buffer[j]);
-            }
+    for (int i = startLink; i < endLink; i++) {
+        if (d.troonAtLink[i] != NO_TROON) {
+            scheduleEvent(arrivalCalendar, d.linkArrivalTick[i], i);
         }
 
-        for (auto &c: troon_vector) {
-            troons.insert(&c);
+        if (d.troonAtPlatform[i] != NO_TROON) {
+            scheduleEvent(departureCalendar, max(d.platformReadyTick[i], firstTick), i);
         }
+    }
+}
 
-        stringstream ss;
-        ss << t << ": ";
-        for (auto &troon: troons) {
-            ss << generateTroonDescription(*troon);
+// First tick in [tick, limit) with a pending event on this rank, limit if there is none. Only meaningful when nothing
+// is touched and nothing spawns anymore, every state change is on the calendars or in pendingArrivals then.
+size_t nextEventTick(size_t tick, size_t limit) {
+    if (!pendingArrivals.empty()) {
+        limit = min(limit, pendingArrivals.begin()->first);
+    }
+    for (size_t k = 0; k < calendarSize && tick + k < limit; k++) {
+        size_t slot = (tick + k) % calendarSize;
+        if (!arrivalCalendar[slot].empty() || !departureCalendar[slot].empty()) {
+            return tick + k;
         }
+    }
+
+    return limit;
+}
 
-        cout << ss.str() << endl;
+// Derives the sweep counters from the event engine state as it is at the end of lastTick.
+void convertEventStateToSweep(size_t lastTick) {
+    dynamicLinkState &d = graphStateDynamic;
+    for (int i = startLink; i < endLink; i++) {
+        d.linkCounter[i] = d.vacatedTick[i] == lastTick ? 0 : 1;
+        d.linkDistance[i] = 0;
+        d.platformCounter[i] = 0;
 
-        for (int i = 1; i < nprocs; i++) {
-            delete[] troons_recv_buffer[i];
+        if (d.troonAtLink[i] != NO_TROON) {
+            d.linkDistance[i] = lastTick - (d.linkArrivalTick[i] - d.distance[i]);
         }
 
-        delete[] troons_counters;
-        delete[] troons_recv_buffer;
-    } else {
-        MPI_Gather(&troon_to_be_received, 1, MPI_INT, NULL, 0, MPI_INT, ORIGINAL_PROC, MPI_COMM_WORLD);
-        MPI_Send(&troon_vector[0], troon_to_be_received, mpi_troon_type, 0, 0, MPI_COMM_WORLD);
+        if (d.troonAtPlatform[i] != NO_TROON) {
+            d.platformCounter[i] = lastTick - (d.platformReadyTick[i] - d.popularity[i] - 2) + 1;
+        }
     }
 }
 
-void spawnTroons(size_t num_green_trains, size_t num_yellow_trains,
+// Drops every troon on a link this rank does not own anymore.
+void releaseLink(size_t link) {
+    dynamicLinkState &d = graphStateDynamic;
+    releaseTroon(d.troonAtLink[link]);
+    releaseTroon(d.troonAtPlatform[link]);
+    d.troonAtLink[link] = NO_TROON;
+    d.troonAtPlatform[link] = NO_TROON;
+
+    while (!d.waitingArea[link].empty()) {
+        releaseTroon(d.waitingArea[link].top());
+        d.waitingArea[link].pop();
+    }
+}
+
+void scheduleEvent(vector<vector<size_t>> &calendar, size_t tick, size_t link) {
+    calendar[tick % calendarSize].push_back(link);
+}
+
+void processArrivalEvents(size_t tick) {
+    dynamicLinkState &d = graphStateDynamic;
+    dueEvents.swap(arrivalCalendar[tick % calendarSize]);
+
+    for (size_t link: dueEvents) {
+        if (d.troonAtLink[link] == NO_TROON || d.linkArrivalTick[link] != tick) continue;
+
+        moveTroonToNextLink(link, tick);
+        d.vacatedTick[link] = tick;
+
+        // the platform troon may have been held back by this link, it can leave next tick at the earliest
+        if (d.troonAtPlatform[link] != NO_TROON) {
+            scheduleEvent(departureCalendar, tick + 1, link);
+        }
+    }
+
+    dueEvents.clear();
+}
+
+void processDepartureEvents(size_t tick) {
+    dynamicLinkState &d = graphStateDynamic;
+    dueEvents.swap(departureCalendar[tick % calendarSize]);
+
+    for (size_t link: dueEvents) {
+
+        // stale or duplicate events, an occupied link schedules a retry once it is vacated
+        if (d.troonAtPlatform[link] == NO_TROON || d.platformReadyTick[link] > tick) continue;
+        if (d.troonAtLink[link] != NO_TROON || d.vacatedTick[link] == tick) continue;
+
+        d.troonAtLink[link] = d.troonAtPlatform[link];
+        troonPool[d.troonAtLink[link]].location = LINK;
+        d.troonAtPlatform[link] = NO_TROON;
+        d.linkArrivalTick[link] = tick + d.distance[link];
+        scheduleEvent(arrivalCalendar, d.linkArrivalTick[link], link);
+        announceDeparture(link, d.linkArrivalTick[link]);
+
+        // the platform is free again
+        pushToWaitingArea(link, NO_TROON);
+    }
+
+    dueEvents.clear();
+}
+
+void processTouchedLinks(size_t tick) {
+    dynamicLinkState &d = graphStateDynamic;
+    for (size_t link: touchedLinks) {
+        d.isTouched[link] = false;
+
+        if (d.troonAtPlatform[link] != NO_TROON || d.waitingArea[link].empty()) continue;
+
+        processWaitingArea(link);
+        d.platformReadyTick[link] = tick + d.popularity[link] + 2;
+        scheduleEvent(departureCalendar, d.platformReadyTick[link], link);
+    }
+
+    touchedLinks.clear();
+}
+
+// Every troon entering a waiting area goes through here. The event engine also uses it with NO_TROON to mark a link
+// whose platform became free.
+void pushToWaitingArea(size_t link, TroonIndex troon) {
+    dynamicLinkState &d = graphStateDynamic;
+    if (troon != NO_TROON) {
+        d.waitingArea[link].push(troon);
+    }
+
+    if (isTrackingTouchedLinks && !d.isTouched[link]) {
+        d.isTouched[link] = true;
+        touchedLinks.push_back(link);
+    }
+}
+
+// Only ranks that own the next link of one of our links can ever receive a troon from us, so the exchange runs on a
+// distributed graph communicator over those neighbours: one neighbour all-to-all for the counts and one for the
+// troons, instead of a world-wide all-to-all plus a send and a receive to every rank.
+void exchangeTroons(size_t tick) {
+    if (useOverlap) {
+        exchangeTroonsOverlapped(tick);
+        return;
+    }
+
+    int outDegree = static_cast<int>(outNeighbors.size());
+    int inDegree = static_cast<int>(inNeighbors.size());
+
+    int totalToSend = 0;
+    for (int j = 0; j < outDegree; j++) {
+        troons_counter[j] = static_cast<int>(troons_buffer_to_send[outNeighbors[j]].size());
+        send_displacements[j] = totalToSend;
+        totalToSend += troons_counter[j];
+    }
+
+    MPI_Neighbor_alltoall(troons_counter.data(), 1, MPI_INT, troons_counter_recv_buffer.data(), 1, MPI_INT,
+                          neighborComm);
+
+    int totalToReceive = 0;
+    for (int j = 0; j < inDegree; j++) {
+        recv_displacements[j] = totalToReceive;
+        totalToReceive += troons_counter_recv_buffer[j];
+    }
+
+#ifdef DEBUG
+    for (int j = 0; j < inDegree; j++) {
+        cout << inNeighbors[j] << " -> " << myid << " at " << tick << " : " << troons_counter_recv_buffer[j] << endl;
+    }
+#endif
+
+    troons_send_buffer.clear();
+    for (int neighbor: outNeighbors) {
+        vector<TroonHandoff> &buffer = troons_buffer_to_send[neighbor];
+        troons_send_buffer.insert(troons_send_buffer.end(), buffer.begin(), buffer.end());
+        buffer.clear();
+    }
+    troons_recv_buffer.resize(totalToReceive);
+
+    MPI_Neighbor_alltoallv(troons_send_buffer.data(), troons_counter.data(), send_displacements.data(),
+                           mpi_handoff_type, troons_recv_buffer.data(), troons_counter_recv_buffer.data(),
+                           recv_displacements.data(), mpi_handoff_type, neighborComm);
+
+    // insert all the troons
+    for (TroonHandoff &handoff: troons_recv_buffer) {
+        Troon t = unpackHandoff(handoff, tick);
+#ifdef DEBUG
+        cout << tick << " | Id: " << myid << " receive troon: " << generateTroonDescription(t) << t.currentLink
+             << endl;
+#endif
+        if (useLookahead) {
+            pendingArrivals[t.arrivalTime].push_back(allocateTroon(t));
+        } else {
+            pushToWaitingArea(t.currentLink, allocateTroon(t));
+        }
+    }
+}
+
+// Recomputes the partition at the end of tick from the troons every link holds now, with the weights of
+// partitionLinks: a link costs 1 per tick plus 1 per troon on it.
+void rebalanceLinks(size_t tick) {
+    double started = MPI_Wtime();
+    dynamicLinkState &d = graphStateDynamic;
+
+    vector<int> counts(nprocs);
+    vector<int> displacements(nprocs);
+    for (int r = 0; r < nprocs; r++) {
+        counts[r] = partitionStart[r + 1] - partitionStart[r];
+        displacements[r] = partitionStart[r];
+    }
+
+    vector<uint32_t> localTroons(endLink - startLink);
+    for (int i = startLink; i < endLink; i++) {
+        size_t troons = (d.troonAtPlatform[i] != NO_TROON) + (d.troonAtLink[i] != NO_TROON);
+        troons += std::distance(d.waitingArea[i].begin(), d.waitingArea[i].end());
+        localTroons[i - startLink] = static_cast<uint32_t>(troons);
+    }
+    vector<uint32_t> linkTroons(graphState.size());
+    MPI_Allgatherv(localTroons.data(), endLink - startLink, MPI_UINT32_T, linkTroons.data(), counts.data(),
+                   displacements.data(), MPI_UINT32_T, MPI_COMM_WORLD);
+
+    // every rank has the same counts, so they all come to the same decision and the same boundaries
+    double totalWeight = 0;
+    double maxRankWeight = 0;
+    for (int r = 0; r < nprocs; r++) {
+        double rankWeight = 0;
+        for (int i = partitionStart[r]; i < partitionStart[r + 1]; i++) {
+            rankWeight += 1.0 + linkTroons[i];
+        }
+        totalWeight += rankWeight;
+        maxRankWeight = max(maxRankWeight, rankWeight);
+    }
+
+    double average = totalWeight / nprocs;
+    if (maxRankWeight * 100 <= average * static_cast<double>(100 + rebalanceThreshold)) {
+        rebalanceSeconds += MPI_Wtime() - started;
+        return;
+    }
+
+    int numLinks = static_cast<int>(graphState.size());
+    vector<int> newStart(nprocs + 1, numLinks);
+    newStart[0] = 0;
+    double prefix = 0;
+    int rank = 1;
+    for (int k = 0; k < numLinks && rank < nprocs; k++) {
+        while (rank < nprocs && prefix >= totalWeight * rank / nprocs) {
+            newStart[rank++] = k;
+        }
+        prefix += 1.0 + linkTroons[k];
+    }
+
+    if (newStart != partitionStart) {
+        migrateLinks(newStart, tick);
+        rebalanceCount++;
+    }
+    rebalanceSeconds += MPI_Wtime() - started;
+}
+
+// Hands the links this rank loses to their new owners together with their troons, then switches to the new partition.
+void migrateLinks(const vector<int> &newStart, size_t tick) {
+    dynamicLinkState &d = graphStateDynamic;
+
+    vector<vector<LinkMigration>> linksTo(nprocs);
+    vector<vector<TroonHandoff>> troonsTo(nprocs);
+    auto packTroon = [](TroonIndex troon) {
+        Troon t = troonPool[troon];
+        TroonHandoff handoff = packHandoff(t);
+        releaseTroon(troon);
+        return handoff;
+    };
+
+    for (int r = 0; r < nprocs; r++) {
+        if (r == myid) continue;
+        int first = max(startLink, newStart[r]);
+        int last = min(endLink, newStart[r + 1]);
+        for (int i = first; i < last; i++) {
+            LinkMigration m{d.platformCounter[i], d.linkCounter[i], d.linkDistance[i], static_cast<uint32_t>(i), 0,
+                            d.troonAtPlatform[i] != NO_TROON, d.troonAtLink[i] != NO_TROON};
+            if (m.hasPlatformTroon) {
+                troonsTo[r].push_back(packTroon(d.troonAtPlatform[i]));
+            }
+            if (m.hasLinkTroon) {
+                troonsTo[r].push_back(packTroon(d.troonAtLink[i]));
+            }
+            for (TroonIndex troon: d.waitingArea[i]) {
+                troonsTo[r].push_back(packTroon(troon));
+                m.numWaiting++;
+            }
+            linksTo[r].push_back(m);
+
+            d.troonAtPlatform[i] = NO_TROON;
+            d.troonAtLink[i] = NO_TROON;
+            d.waitingArea[i] = ArrivalQueue();
+        }
+    }
+
+    // links and troons per rank in one round
+    vector<int> sendCounts(2 * nprocs);
+    vector<int> recvCounts(2 * nprocs);
+    for (int r = 0; r < nprocs; r++) {
+        sendCounts[2 * r] = static_cast<int>(linksTo[r].size());
+        sendCounts[2 * r + 1] = static_cast<int>(troonsTo[r].size());
+    }
+    MPI_Alltoall(sendCounts.data(), 2, MPI_INT, recvCounts.data(), 2, MPI_INT, MPI_COMM_WORLD);
+
+    vector<LinkMigration> linksOut, linksIn;
+    vector<TroonHandoff> troonsOut, troonsIn;
+    vector<int> linkCounts(nprocs), linkDisplacements(nprocs), troonCounts(nprocs), troonDisplacements(nprocs);
+    vector<int> linkRecvCounts(nprocs), linkRecvDisplacements(nprocs);
+    vector<int> troonRecvCounts(nprocs), troonRecvDisplacements(nprocs);
+    for (int r = 0; r < nprocs; r++) {
+        linkCounts[r] = sendCounts[2 * r];
+        linkDisplacements[r] = static_cast<int>(linksOut.size());
+        linksOut.insert(linksOut.end(), linksTo[r].begin(), linksTo[r].end());
+        troonCounts[r] = sendCounts[2 * r + 1];
+        troonDisplacements[r] = static_cast<int>(troonsOut.size());
+        troonsOut.insert(troonsOut.end(), troonsTo[r].begin(), troonsTo[r].end());
+
+        linkRecvCounts[r] = recvCounts[2 * r];
+        linkRecvDisplacements[r] = r == 0 ? 0 : linkRecvDisplacements[r - 1] + linkRecvCounts[r - 1];
+        troonRecvCounts[r] = recvCounts[2 * r + 1];
+        troonRecvDisplacements[r] = r == 0 ? 0 : troonRecvDisplacements[r - 1] + troonRecvCounts[r - 1];
+    }
+    linksIn.resize(linkRecvDisplacements[nprocs - 1] + linkRecvCounts[nprocs - 1]);
+    troonsIn.resize(troonRecvDisplacements[nprocs - 1] + troonRecvCounts[nprocs - 1]);
+
+    MPI_Datatype mpi_migration_type;
+    MPI_Type_contiguous(sizeof(LinkMigration), MPI_BYTE, &mpi_migration_type);
+    MPI_Type_commit(&mpi_migration_type);
+    MPI_Alltoallv(linksOut.data(), linkCounts.data(), linkDisplacements.data(), mpi_migration_type, linksIn.data(),
+                  linkRecvCounts.data(), linkRecvDisplacements.data(), mpi_migration_type, MPI_COMM_WORLD);
+    MPI_Type_free(&mpi_migration_type);
+    MPI_Alltoallv(troonsOut.data(), troonCounts.data(), troonDisplacements.data(), mpi_handoff_type, troonsIn.data(),
+                  troonRecvCounts.data(), troonRecvDisplacements.data(), mpi_handoff_type, MPI_COMM_WORLD);
+
+    // the troons arrived at or before tick, unpackHandoff only handles the ones ahead of it
+    size_t next = 0;
+    auto unpackTroon = [&](size_t location) {
+        Troon t = unpackHandoff(troonsIn[next], tick);
+        t.arrivalTime = tick - static_cast<uint32_t>(static_cast<uint32_t>(tick) - troonsIn[next].arrivalTick);
+        t.location = location;
+        next++;
+        return allocateTroon(t);
+    };
+    for (const LinkMigration &m: linksIn) {
+        d.platformCounter[m.link] = m.platformCounter;
+        d.linkCounter[m.link] = m.linkCounter;
+        d.linkDistance[m.link] = m.linkDistance;
+        d.troonAtPlatform[m.link] = m.hasPlatformTroon ? unpackTroon(PLATFORM) : NO_TROON;
+        d.troonAtLink[m.link] = m.hasLinkTroon ? unpackTroon(LINK) : NO_TROON;
+        for (uint32_t k = 0; k < m.numWaiting; k++) {
+            d.waitingArea[m.link].push(unpackTroon(WAITING_AREA));
+        }
+    }
+
+    migratedLinks += linksOut.size();
+    migratedTroons += troonsOut.size();
+
+    partitionStart = newStart;
+    for (int r = 0; r < nprocs; r++) {
+        for (int i = partitionStart[r]; i < partitionStart[r + 1]; i++) {
+            linkOwner[i] = r;
+        }
+    }
+    startLink = partitionStart[myid];
+    endLink = partitionStart[myid + 1];
+
+    MPI_Comm_free(&neighborComm);
+    createNeighborhood();
+    if (numThreads > 1) {
+        resetChunks();
+    }
+
+#ifdef DEBUG
+    cout << tick << " | " << myid << " now handles " << startLink << " -> " << endLink - 1 << endl;
+#endif
+}
+
+// Rank 0 reports how often the partition changed and what moving the links cost, the time is the slowest rank's.
+void reportRebalancing() {
+    unsigned long long moved[2] = {migratedLinks, migratedTroons};
+    unsigned long long totalMoved[2];
+    double seconds;
+    MPI_Reduce(moved, totalMoved, 2, MPI_UNSIGNED_LONG_LONG, MPI_SUM, ORIGINAL_PROC, MPI_COMM_WORLD);
+    MPI_Reduce(&rebalanceSeconds, &seconds, 1, MPI_DOUBLE, MPI_MAX, ORIGINAL_PROC, MPI_COMM_WORLD);
+
+    if (myid == ORIGINAL_PROC) {
+        std::cerr << "rebalanced " << rebalanceCount << " times, migrated " << totalMoved[0] << " links and "
+                  << totalMoved[1] << " troons in " << seconds * 1000 << " ms\n";
+    }
+}
+
+void profileStart() {
+    if (!useProfile) return;
+    std::fill(phaseSeconds, phaseSeconds + NUM_PHASES, 0.0);
+    lastPhaseMark = std::chrono::steady_clock::now();
+}
+
+void profilePhase(int phase) {
+    if (!useProfile) return;
+    auto now = std::chrono::steady_clock::now();
+    phaseSeconds[phase] += std::chrono::duration<double>(now - lastPhaseMark).count();
+    lastPhaseMark = now;
+}
+
+// Rank 0 prints min, average and max over the ranks of the time spent in every phase, the last column is max / average.
+// A rank waiting for a slower one in a collective spends that time in the phase of the collective.
+void reportProfile() {
+    double seconds[NUM_PHASES + 1];
+    std::copy(phaseSeconds, phaseSeconds + NUM_PHASES, seconds);
+    seconds[NUM_PHASES] = 0;
+    for (int p = 0; p < NUM_PHASES; p++) {
+        seconds[NUM_PHASES] += phaseSeconds[p];
+    }
+
+    double minSeconds[NUM_PHASES + 1];
+    double maxSeconds[NUM_PHASES + 1];
+    double sumSeconds[NUM_PHASES + 1];
+    MPI_Reduce(seconds, minSeconds, NUM_PHASES + 1, MPI_DOUBLE, MPI_MIN, ORIGINAL_PROC, MPI_COMM_WORLD);
+    MPI_Reduce(seconds, maxSeconds, NUM_PHASES + 1, MPI_DOUBLE, MPI_MAX, ORIGINAL_PROC, MPI_COMM_WORLD);
+    MPI_Reduce(seconds, sumSeconds, NUM_PHASES + 1, MPI_DOUBLE, MPI_SUM, ORIGINAL_PROC, MPI_COMM_WORLD);
+    if (myid != ORIGINAL_PROC) return;
+
+    std::cerr << std::left << std::setw(14) << "phase" << std::right << std::setw(12) << "min ms" << std::setw(12)
+              << "avg ms" << std::setw(12) << "max ms" << std::setw(12) << "imbalance" << '\n'
+              << std::fixed << std::setprecision(3);
+    for (int p = 0; p <= NUM_PHASES; p++) {
+        double average = sumSeconds[p] / nprocs;
+        std::cerr << std::left << std::setw(14) << (p < NUM_PHASES ? phaseNames[p] : "total") << std::right
+                  << std::setw(12) << minSeconds[p] * 1000 << std::setw(12) << average * 1000 << std::setw(12)
+                  << maxSeconds[p] * 1000 << std::setw(12) << (average > 0 ? maxSeconds[p] / average : 1.0) << '\n';
+    }
+}
+
+// Derives the neighbour ranks from the line cycles: a link on a line hands its troons to the next link on that line.
+void createNeighborhood() {
+    vector<bool> isOut(nprocs, false);
+    vector<bool> isIn(nprocs, false);
+
+    forEachLineStep([&](size_t, size_t link, size_t next) {
+        int from = linkOwner[link];
+        int to = linkOwner[next];
+        if (from != to && from == myid) isOut[to] = true;
+        if (from != to && to == myid) isIn[from] = true;
+    });
+
+    outNeighbors.clear();
+    inNeighbors.clear();
+    for (int r = 0; r < nprocs; r++) {
+        if (isOut[r]) outNeighbors.push_back(r);
+        if (isIn[r]) inNeighbors.push_back(r);
+    }
+
+    MPI_Dist_graph_create_adjacent(MPI_COMM_WORLD, static_cast<int>(inNeighbors.size()), inNeighbors.data(),
+                                   MPI_UNWEIGHTED, static_cast<int>(outNeighbors.size()), outNeighbors.data(),
+                                   MPI_UNWEIGHTED, MPI_INFO_NULL, 0, &neighborComm);
+
+    troons_counter.assign(outNeighbors.size(), 0);
+    send_displacements.assign(outNeighbors.size(), 0);
+    troons_counter_recv_buffer.assign(inNeighbors.size(), 0);
+    recv_displacements.assign(inNeighbors.size(), 0);
+}
+
+// Overlap mode exchange. The receives were posted at the end of the previous exchange, so only the sends are new. Once
+// everything arrived, the receives for the next tick are posted again before the rank goes on with the rest of the
+// tick. Messages between two ranks are not overtaking, one per tick keeps them apart without tags.
+void exchangeTroonsOverlapped(size_t tick) {
+    overlap_send_requests.resize(outNeighbors.size());
+    for (size_t j = 0; j < outNeighbors.size(); j++) {
+        vector<TroonHandoff> &buffer = troons_buffer_to_send[outNeighbors[j]];
+        MPI_Isend(buffer.data(), static_cast<int>(buffer.size()), mpi_handoff_type, outNeighbors[j], 0, neighborComm,
+                  &overlap_send_requests[j]);
+    }
+
+    vector<MPI_Status> statuses(inNeighbors.size());
+    MPI_Waitall(static_cast<int>(overlap_recv_requests.size()), overlap_recv_requests.data(), statuses.data());
+    MPI_Waitall(static_cast<int>(overlap_send_requests.size()), overlap_send_requests.data(), MPI_STATUSES_IGNORE);
+
+    for (int neighbor: outNeighbors) {
+        troons_buffer_to_send[neighbor].clear();
+    }
+
+    for (size_t j = 0; j < inNeighbors.size(); j++) {
+        int received;
+        MPI_Get_count(&statuses[j], mpi_handoff_type, &received);
+        for (int k = 0; k < received; k++) {
+            Troon t = unpackHandoff(overlap_recv_buffers[j][k], tick);
+            pushToWaitingArea(t.currentLink, allocateTroon(t));
+        }
+    }
+
+    if (!overlap_recv_requests.empty()) {
+        MPI_Startall(static_cast<int>(overlap_recv_requests.size()), overlap_recv_requests.data());
+    }
+}
+
+// A link releases at most one troon per tick, so a neighbour can send at most as many troons as it owns links leading
+// into this rank.
+void createOverlapRequests() {
+    vector<bool> isCounted(graphState.size(), false);
+    vector<int> linksInto(nprocs, 0);
+
+    forEachLineStep([&](size_t, size_t link, size_t next) {
+        if (linkOwner[next] == myid && linkOwner[link] != myid && !isCounted[link]) {
+            isCounted[link] = true;
+            linksInto[linkOwner[link]]++;
+        }
+    });
+
+    overlap_recv_buffers.assign(inNeighbors.size(), vector<TroonHandoff>());
+    overlap_recv_requests.assign(inNeighbors.size(), MPI_REQUEST_NULL);
+    for (size_t j = 0; j < inNeighbors.size(); j++) {
+        overlap_recv_buffers[j].resize(linksInto[inNeighbors[j]]);
+        MPI_Recv_init(overlap_recv_buffers[j].data(), linksInto[inNeighbors[j]], mpi_handoff_type, inNeighbors[j], 0,
+                      neighborComm, &overlap_recv_requests[j]);
+    }
+
+    if (!overlap_recv_requests.empty()) {
+        MPI_Startall(static_cast<int>(overlap_recv_requests.size()), overlap_recv_requests.data());
+    }
+}
+
+// Per-tick latency of the exchange protocols alone, with nothing to exchange: the original barrier, all-to-all,
+// point-to-point round to every rank and barrier, the neighbourhood collectives, and the pre-posted receives of
+// --overlap. Reports the slowest rank.
+void runTickBenchmark() {
+    const int warmup = 100;
+    const int iterations = 10000;
+
+    vector<int> counts(nprocs, 0);
+    vector<int> recvCounts(nprocs, 0);
+    vector<MPI_Request> requests(nprocs * 2);
+    TroonHandoff dummy;
+
+    auto measure = [&](const std::function<void()> &round) {
+        for (int i = 0; i < warmup; i++) {
+            round();
+        }
+
+        MPI_Barrier(MPI_COMM_WORLD);
+        double start = MPI_Wtime();
+        for (int i = 0; i < iterations; i++) {
+            round();
+        }
+        double elapsed = MPI_Wtime() - start;
+
+        double slowest;
+        MPI_Reduce(&elapsed, &slowest, 1, MPI_DOUBLE, MPI_MAX, ORIGINAL_PROC, MPI_COMM_WORLD);
+        return slowest / iterations * 1e6;
+    };
+
+    double dense = measure([&]() {
+        MPI_Barrier(MPI_COMM_WORLD);
+        MPI_Alltoall(counts.data(), 1, MPI_INT, recvCounts.data(), 1, MPI_INT, MPI_COMM_WORLD);
+        for (int i = 0; i < nprocs; i++) {
+            MPI_Isend(&dummy, 0, mpi_handoff_type, i, 1, MPI_COMM_WORLD, &requests[i * 2]);
+            MPI_Irecv(&dummy, 0, mpi_handoff_type, i, 1, MPI_COMM_WORLD, &requests[i * 2 + 1]);
+        }
+        MPI_Waitall(nprocs * 2, requests.data(), MPI_STATUSES_IGNORE);
+        MPI_Barrier(MPI_COMM_WORLD);
+    });
+
+    bool wasOverlap = useOverlap;
+    useOverlap = false;
+    double neighbor = measure([]() { exchangeTroons(0); });
+    useOverlap = true;
+    double overlapped = measure([]() { exchangeTroons(0); });
+    useOverlap = wasOverlap;
+
+    if (myid == ORIGINAL_PROC) {
+        cout << "ranks " << nprocs << ", us per tick: dense " << dense << ", neighbor " << neighbor << ", overlap "
+             << overlapped << endl;
+    }
+}
+
+// Rank 0 has loaded the network, the other ranks only need the run parameters, the terminals and the link array.
+// Every rank builds graphState from the records. Station names are only used for printing, which happens on rank 0.
+void broadcastTopology(NetworkInput &input) {
+    uint64_t header[TOPOLOGY_HEADER_SIZE] = {
+            input.ticks, input.num_green_trains, input.num_yellow_trains, input.num_blue_trains, input.num_lines,
+            input.num_links,
+            terminalGreenForward, terminalGreenReverse,
+            terminalYellowForward, terminalYellowReverse,
+            terminalBlueForward, terminalBlueReverse
+    };
+    MPI_Bcast(header, TOPOLOGY_HEADER_SIZE, MPI_UINT64_T, ORIGINAL_PROC, MPI_COMM_WORLD);
+
+    size_t numLinks = header[5];
+    vector<LinkRecord> received;
+    LinkRecord *records;
+    if (myid == ORIGINAL_PROC) {
+        records = const_cast<LinkRecord *>(input.link_records); // the root only reads it, it may be a mapped file
+    } else {
+        received.resize(numLinks);
+        records = received.data();
+    }
+
+    MPI_Datatype mpi_link_type;
+    MPI_Type_contiguous(sizeof(LinkRecord), MPI_BYTE, &mpi_link_type);
+    MPI_Type_commit(&mpi_link_type);
+    MPI_Bcast(records, static_cast<int>(numLinks), mpi_link_type, ORIGINAL_PROC, MPI_COMM_WORLD);
+    MPI_Type_free(&mpi_link_type);
+
+    if (myid != ORIGINAL_PROC) {
+        input.ticks = header[0];
+        input.num_green_trains = header[1];
+        input.num_yellow_trains = header[2];
+        input.num_blue_trains = header[3];
+        input.num_lines = header[4];
+        terminalGreenForward = header[6];
+        terminalGreenReverse = header[7];
+        terminalYellowForward = header[8];
+        terminalYellowReverse = header[9];
+        terminalBlueForward = header[10];
+        terminalBlueReverse = header[11];
+    }
+
+    graphState.resize(numLinks);
+    for (size_t i = 0; i < numLinks; i++) {
+        const LinkRecord &r = records[i];
+        staticLinkState &s = graphState[i];
+        s.popularity = r.popularity;
+        s.distance = r.distance;
+        s.nextLinkGreen = r.nextLinkGreen;
+        s.nextLinkYellow = r.nextLinkYellow;
+        s.nextLinkBlue = r.nextLinkBlue;
+        s.srcId = r.srcId;
+        s.destId = r.destId;
+        s.id = i;
+    }
+    graphCounter = numLinks;
+
+    // the debug output and --output format troons on every rank
+#ifndef DEBUG
+    if (outputPath.empty()) return;
+#endif
+    string names;
+    for (auto &name: stationIdNameMapping) {
+        names += name;
+        names += '\n';
+    }
+    uint64_t namesLength = names.size();
+    MPI_Bcast(&namesLength, 1, MPI_UINT64_T, ORIGINAL_PROC, MPI_COMM_WORLD);
+    names.resize(namesLength);
+    MPI_Bcast(&names[0], static_cast<int>(namesLength), MPI_CHAR, ORIGINAL_PROC, MPI_COMM_WORLD);
+    if (myid != ORIGINAL_PROC) {
+        stringstream ns(names);
+        string name;
+        while (std::getline(ns, name)) {
+            stationIdNameMapping.push_back(name);
+        }
+    }
+}
+
+void createMpiTypes() {
+    MPI_Type_contiguous(3, MPI_UINT32_T, &mpi_handoff_type);
+    MPI_Type_commit(&mpi_handoff_type);
+
+    MPI_Type_contiguous(2, MPI_UINT32_T, &mpi_snapshot_type);
+    MPI_Type_commit(&mpi_snapshot_type);
+}
+
+TroonHandoff packHandoff(const Troon &troon) {
+    return TroonHandoff{
+            static_cast<uint32_t>(troon.id),
+            static_cast<uint32_t>(troon.currentLink << 2 | troon.line),
+            static_cast<uint32_t>(troon.arrivalTime)
+    };
+}
+
+// tick is the tick of the exchange, arrivals are never before it
+Troon unpackHandoff(const TroonHandoff &handoff, size_t tick) {
+    size_t link = handoff.linkAndLine >> 2;
+    size_t line = handoff.linkAndLine & 3;
+    uint32_t ahead = handoff.arrivalTick - static_cast<uint32_t>(tick);
+
+    return Troon{
+            tick + ahead,
+            handoff.id,
+            graphState[link].srcId,
+            graphState[link].destId,
+            WAITING_AREA,
+            line,
+            link,
+            computeTroonSortKey(handoff.id, line)
+    };
+}
+
+TroonSnapshot packSnapshot(const Troon &troon) {
+    return TroonSnapshot{
+            static_cast<uint32_t>(troon.id),
+            static_cast<uint32_t>(troon.currentLink << 4 | troon.line << 2 | troon.location)
+    };
+}
+
+Troon unpackSnapshot(const TroonSnapshot &snapshot) {
+    size_t link = snapshot.linkLineLocation >> 4;
+    size_t line = (snapshot.linkLineLocation >> 2) & 3;
+
+    return Troon{
+            0,
+            snapshot.id,
+            graphState[link].srcId,
+            graphState[link].destId,
+            snapshot.linkLineLocation & 3,
+            line,
+            link,
+            computeTroonSortKey(snapshot.id, line)
+    };
+}
+
+void clean() {
+    stopWriter();
+    if (trajectoryFile.is_open()) {
+        trajectoryFile.close();
+        if (!trajectoryFile) {
+            std::cerr << "Failed to write " << trajectoryPath << '\n';
+        }
+    }
+
+    graphStateDynamic = dynamicLinkState();
+
+    // troons in the waiting areas and the ones announced for ticks after the last one all live in the arena
+    troonPool.clear();
+    freeTroons.clear();
+    pendingArrivals.clear();
+
+    for (MPI_Request &request: overlap_recv_requests) { // posted for the tick after the last one
+        MPI_Cancel(&request);
+        MPI_Wait(&request, MPI_STATUS_IGNORE);
+        MPI_Request_free(&request);
+    }
+
+    MPI_Comm_free(&neighborComm);
+
+    if (!outputPath.empty()) {
+        MPI_File_close(&outputFile);
+    }
+}
+
+void printTroons(size_t ticks, size_t num_lines, size_t t) {
+    if (ticks - t > num_lines) return;
+
+    dynamicLinkState &d = graphStateDynamic;
+
+    vector<Troon> &troon_vector = printedTroons;
+    troon_vector.clear();
+
+    for (int i = startLink; i < endLink; i++) {
+        if (d.troonAtLink[i] != NO_TROON) {
+            troon_vector.push_back(troonPool[d.troonAtLink[i]]);
+        }
+
+        if (d.troonAtPlatform[i] != NO_TROON) {
+            troon_vector.push_back(troonPool[d.troonAtPlatform[i]]);
+        }
+
+        for (TroonIndex troon: d.waitingArea[i]) {
+            troon_vector.push_back(troonPool[troon]);
+        }
+    }
+
+#ifdef DEBUG
+    stringstream ss;
+    ss << myid << " -> " << t << ": ";
+    for (auto &troon: troon_vector) {
+        ss << generateTroonDescription(troon);
+    }
+
+    cout << ss.str() << endl;
+    return;
+#endif
+
+    // each rank sends a run that is already in output order, rank 0 only has to merge the runs
+    std::sort(troon_vector.begin(), troon_vector.end(), TroonSortKeyComparison());
+
+    vector<TroonSnapshot> &snapshots = printedSnapshots;
+    snapshots.clear();
+    for (auto &troon: troon_vector) {
+        snapshots.push_back(packSnapshot(troon));
+    }
+
+    if (!outputPath.empty()) {
+        writeTroons(t);
+        return;
+    }
+
+    int troon_to_be_received = static_cast<int>(snapshots.size());
+    if (myid == ORIGINAL_PROC) {
+        OutputSlot &slot = acquireOutputSlot();
+        slot.tick = t;
+        slot.counts.resize(nprocs);
+        MPI_Gather(&troon_to_be_received, 1, MPI_INT, slot.counts.data(), 1, MPI_INT, ORIGINAL_PROC, MPI_COMM_WORLD);
+
+        size_t total = 0;
+        for (int count: slot.counts) {
+            total += count;
+        }
+        slot.snapshots.resize(total);
+
+        size_t offset = 0;
+        for (int i = 0; i < nprocs; i++) {
+            if (i == ORIGINAL_PROC) {
+                std::copy(snapshots.begin(), snapshots.end(), slot.snapshots.begin() + static_cast<ptrdiff_t>(offset));
+            } else {
+                MPI_Recv(slot.snapshots.data() + offset, slot.counts[i], mpi_snapshot_type, i, 0, MPI_COMM_WORLD,
+                         MPI_STATUS_IGNORE);
+            }
+            offset += slot.counts[i];
+        }
+
+        publishOutputSlot();
+    } else {
+        MPI_Gather(&troon_to_be_received, 1, MPI_INT, NULL, 0, MPI_INT, ORIGINAL_PROC, MPI_COMM_WORLD);
+        MPI_Send(snapshots.data(), troon_to_be_received, mpi_snapshot_type, 0, 0, MPI_COMM_WORLD);
+    }
+}
+
+void spawnTroons(size_t num_green_trains, size_t num_yellow_trains,
                  size_t num_blue_trains, size_t t) {
     bool isGreenMine =
             startLink <= static_cast<int>(terminalGreenForward) && static_cast<int>(terminalGreenForward) < endLink;
@@ -471,347 +1837,1442 @@ void spawnTroons(size_t num_green_trains, size_t num_yellow_trains,
 
     if (greenTroonCounter < num_green_trains) {
         if (isGreenMine) {
-            auto *troon = new Troon{
+            TroonIndex troon = allocateTroon(Troon{
                     t,
                     troonIdCounter,
-                    graphStateDynamic[terminalGreenForward]->state.srcId,
-                    graphStateDynamic[terminalGreenForward]->state.destId,
+                    graphState[terminalGreenForward].srcId,
+                    graphState[terminalGreenForward].destId,
                     WAITING_AREA,
                     GREEN,
-                    terminalGreenForward
-            };
+                    terminalGreenForward,
+                    computeTroonSortKey(troonIdCounter, GREEN)
+            });
 
-            graphStateDynamic[terminalGreenForward]->waitingArea.push(troon);
+            pushToWaitingArea(terminalGreenForward, troon);
         }
 
         greenTroonCounter++;
-        troonIdCounter++;
+        countSpawnedTroon(GREEN);
     }
 
     if (greenTroonCounter < num_green_trains) {
         if (isGreenReverseMine) {
-            auto *troon = new Troon{
+            TroonIndex troon = allocateTroon(Troon{
                     t,
                     troonIdCounter,
-                    graphStateDynamic[terminalGreenReverse]->state.srcId,
-                    graphStateDynamic[terminalGreenReverse]->state.destId,
+                    graphState[terminalGreenReverse].srcId,
+                    graphState[terminalGreenReverse].destId,
                     WAITING_AREA,
                     GREEN,
-                    terminalGreenReverse
-            };
+                    terminalGreenReverse,
+                    computeTroonSortKey(troonIdCounter, GREEN)
+            });
 
-            graphStateDynamic[terminalGreenReverse]->waitingArea.push(troon);
+            pushToWaitingArea(terminalGreenReverse, troon);
         }
 
         greenTroonCounter++;
-        troonIdCounter++;
+        countSpawnedTroon(GREEN);
     }
 
     if (yellowTroonCounter < num_yellow_trains) {
         if (isYellowMine) {
-            auto *troon = new Troon{
+            TroonIndex troon = allocateTroon(Troon{
                     t,
                     troonIdCounter,
-                    graphStateDynamic[terminalYellowForward]->state.srcId,
-                    graphStateDynamic[terminalYellowForward]->state.destId,
+                    graphState[terminalYellowForward].srcId,
+                    graphState[terminalYellowForward].destId,
                     WAITING_AREA,
                     YELLOW,
-                    terminalYellowForward
-            };
+                    terminalYellowForward,
+                    computeTroonSortKey(troonIdCounter, YELLOW)
+            });
 
-            graphStateDynamic[terminalYellowForward]->waitingArea.push(troon);
+            pushToWaitingArea(terminalYellowForward, troon);
         }
 
         yellowTroonCounter++;
-        troonIdCounter++;
+        countSpawnedTroon(YELLOW);
     }
 
     if (yellowTroonCounter < num_yellow_trains) {
         if (isYellowReverseMine) {
-            auto *troon = new Troon{
+            TroonIndex troon = allocateTroon(Troon{
                     t,
                     troonIdCounter,
-                    graphStateDynamic[terminalYellowReverse]->state.srcId,
-                    graphStateDynamic[terminalYellowReverse]->state.destId,
+                    graphState[terminalYellowReverse].srcId,
+                    graphState[terminalYellowReverse].destId,
                     WAITING_AREA,
                     YELLOW,
-                    terminalYellowReverse
-            };
+                    terminalYellowReverse,
+                    computeTroonSortKey(troonIdCounter, YELLOW)
+            });
+
+            pushToWaitingArea(terminalYellowReverse, troon);
+        }
+
+        yellowTroonCounter++;
+        countSpawnedTroon(YELLOW);
+    }
+
+    if (blueTroonCounter < num_blue_trains) {
+        if (isBlueMine) {
+            TroonIndex troon = allocateTroon(Troon{
+                    t,
+                    troonIdCounter,
+                    graphState[terminalBlueForward].srcId,
+                    graphState[terminalBlueForward].destId,
+                    WAITING_AREA,
+                    BLUE,
+                    terminalBlueForward,
+                    computeTroonSortKey(troonIdCounter, BLUE)
+            });
+
+            pushToWaitingArea(terminalBlueForward, troon);
+        }
+
+        blueTroonCounter++;
+        countSpawnedTroon(BLUE);
+    }
+
+    if (blueTroonCounter < num_blue_trains) {
+        if (isBlueReverseMine) {
+            TroonIndex troon = allocateTroon(Troon{
+                    t,
+                    troonIdCounter,
+                    graphState[terminalBlueReverse].srcId,
+                    graphState[terminalBlueReverse].destId,
+                    WAITING_AREA,
+                    BLUE,
+                    terminalBlueReverse,
+                    computeTroonSortKey(troonIdCounter, BLUE)
+            });
 
-            graphStateDynamic[terminalYellowReverse]->waitingArea.push(troon);
+            pushToWaitingArea(terminalBlueReverse, troon);
         }
 
-        yellowTroonCounter++;
-        troonIdCounter++;
+        blueTroonCounter++;
+        countSpawnedTroon(BLUE);
+    }
+}
+
+// Every rank spawns every troon id, the ones on other ranks only count here.
+void countSpawnedTroon(size_t line) {
+    if (!outputPath.empty()) {
+        spawnedSortKeys.push_back(computeTroonSortKey(troonIdCounter, line));
+    }
+    troonIdCounter++;
+}
+
+TroonIndex allocateTroon(const Troon &troon) {
+    if (freeTroons.empty()) {
+        troonPool.push_back(troon);
+        return static_cast<TroonIndex>(troonPool.size() - 1);
+    }
+
+    TroonIndex index = freeTroons.back();
+    freeTroons.pop_back();
+    troonPool[index] = troon;
+    return index;
+}
+
+void releaseTroon(TroonIndex index) {
+    if (index != NO_TROON) {
+        freeTroons.push_back(index);
+    }
+}
+
+// A free link counts the ticks since it was vacated, an occupied one how far its troon got.
+void processLinks(size_t tick) {
+    runThreadPhase([tick](int begin, int end) {
+        vector<int> &slow = phaseSlowLinks();
+        slow.clear();
+        sweepKernels->updateLinks(begin, end, slow);
+        for (int link: slow) {
+            moveTroonToNextLink(link, tick);
+        }
+    });
+    mergeThreadBuffers();
+}
+
+// Runs phase(begin, end) over [startLink, endLink). With threads, every thread starts on an equal run of chunks and
+// steals from the back of the others' runs once its own is done.
+template<typename Phase>
+void runThreadPhase(Phase phase) {
+    if (numThreads == 1) {
+        phase(startLink, endLink);
+        return;
+    }
+#ifdef _OPENMP
+#pragma omp parallel num_threads(numThreads)
+    {
+        int thread = omp_get_thread_num();
+        uint64_t chunks = chunkStart.size() - 1;
+        uint64_t first = chunks * thread / numThreads;
+        uint64_t last = chunks * (thread + 1) / numThreads;
+        chunkQueues[thread].range.store(first << 32 | last, std::memory_order_relaxed);
+#pragma omp barrier
+
+        for (int chunk = takeChunk(thread); chunk >= 0; chunk = takeChunk(thread)) {
+            double started = omp_get_wtime();
+            phase(chunkStart[chunk], chunkStart[chunk + 1]);
+            chunkCost[chunk] += omp_get_wtime() - started;
+        }
+    }
+#endif
+}
+
+// The next chunk of the thread's own run, or one stolen from the back of another run, -1 once all runs are empty.
+// Runs only shrink during a phase, so a pass that finds all of them empty means the phase is done.
+int takeChunk(int thread) {
+    std::atomic<uint64_t> &own = chunkQueues[thread].range;
+    uint64_t range = own.load(std::memory_order_relaxed);
+    while ((range >> 32) < (range & UINT32_MAX)) {
+        if (own.compare_exchange_weak(range, range + (1ULL << 32), std::memory_order_relaxed)) {
+            return static_cast<int>(range >> 32);
+        }
+    }
+
+    for (int i = 1; i < numThreads; i++) {
+        std::atomic<uint64_t> &victim = chunkQueues[(thread + i) % numThreads].range;
+        range = victim.load(std::memory_order_relaxed);
+        while ((range >> 32) < (range & UINT32_MAX)) {
+            if (victim.compare_exchange_weak(range, range - 1, std::memory_order_relaxed)) {
+                return static_cast<int>((range & UINT32_MAX) - 1);
+            }
+        }
+    }
+    return -1;
+}
+
+// One chunk over the whole range, which the next adaptChunks cuts evenly.
+void resetChunks() {
+    chunkStart = {startLink, endLink};
+    chunkCost = {1.0};
+}
+
+// Recuts the chunks so that each carries the same share of the measured cost, taking the cost within a chunk as spread
+// evenly over its links. Chunks stay at least MIN_CHUNK_LINKS long to keep the kernels vectorized.
+void adaptChunks() {
+    double total = 0;
+    for (double cost: chunkCost) {
+        total += cost;
+    }
+
+    size_t target = static_cast<size_t>(numThreads) * CHUNKS_PER_THREAD;
+    vector<int> cuts = {startLink};
+    if (total > 0) {
+        double share = total / static_cast<double>(target);
+        double cut = share;
+        double done = 0;
+        for (size_t c = 0; c + 1 < chunkStart.size(); c++) {
+            double cost = chunkCost[c];
+            int links = chunkStart[c + 1] - chunkStart[c];
+            while (done + cost >= cut && cuts.size() < target) {
+                int position = chunkStart[c] + static_cast<int>((cut - done) / cost * links);
+                if (position - cuts.back() >= MIN_CHUNK_LINKS && endLink - position >= MIN_CHUNK_LINKS) {
+                    cuts.push_back(position);
+                }
+                cut += share;
+            }
+            done += cost;
+        }
+    }
+    cuts.push_back(endLink);
+
+    chunkStart.swap(cuts);
+    chunkCost.assign(chunkStart.size() - 1, 0.0);
+}
+
+// The slow path list of the running phase, per thread inside a parallel phase.
+vector<int> &phaseSlowLinks() {
+    ThreadBuffers *buffers = currentThreadBuffers();
+    return buffers != nullptr ? buffers->slowLinks : slowLinks;
+}
+
+// nullptr outside a parallel phase, where everything is applied directly
+ThreadBuffers *currentThreadBuffers() {
+#ifdef _OPENMP
+    if (omp_in_parallel()) {
+        return &threadBuffers[omp_get_thread_num()];
+    }
+#endif
+    return nullptr;
+}
+
+// Applies what the threads deferred, in thread order. The waiting areas order by (arrivalTime, id), so the order of
+// the pushes does not change the output.
+void mergeThreadBuffers() {
+    for (ThreadBuffers &buffers: threadBuffers) {
+        for (TroonIndex troon: buffers.arrivals) {
+            pushToWaitingArea(troonPool[troon].currentLink, troon);
+        }
+        buffers.arrivals.clear();
+
+        for (TroonIndex troon: buffers.released) {
+            releaseTroon(troon);
+        }
+        buffers.released.clear();
+
+        for (size_t rank = 0; rank < buffers.handoffs.size(); rank++) {
+            vector<TroonHandoff> &handoffs = buffers.handoffs[rank];
+            troons_buffer_to_send[rank].insert(troons_buffer_to_send[rank].end(), handoffs.begin(), handoffs.end());
+            handoffs.clear();
+        }
+    }
+}
+
+void moveTroonToNextLink(size_t link, size_t tick) {
+    dynamicLinkState &d = graphStateDynamic;
+    Troon *currTroon = &troonPool[d.troonAtLink[link]];
+    currTroon->arrivalTime = tick;
+    currTroon->location = WAITING_AREA;
+
+    size_t nextLink = nextLinkOnLine(graphState[link], currTroon->line);
+
+    currTroon->src = graphState[nextLink].srcId;
+    currTroon->dest = graphState[nextLink].destId;
+    currTroon->currentLink = nextLink;
+    ThreadBuffers *buffers = currentThreadBuffers();
+    if (startLink <= static_cast<int>(nextLink) && static_cast<int>(nextLink) < endLink) {
+        // the next link may belong to another thread's chunk, so pushes wait for the end of the phase
+        if (buffers != nullptr) {
+            buffers->arrivals.push_back(d.troonAtLink[link]);
+        } else {
+            pushToWaitingArea(nextLink, d.troonAtLink[link]);
+        }
+    } else {
+        // buffer it to be sent to other nodes, in lookahead mode that already happened in announceDeparture
+        if (!useLookahead) {
+            int nextNode = linkOwner[nextLink];
+            auto &buffer = buffers != nullptr ? buffers->handoffs[nextNode] : troons_buffer_to_send[nextNode];
+            buffer.push_back(packHandoff(*currTroon));
+        }
+        if (buffers != nullptr) {
+            buffers->released.push_back(d.troonAtLink[link]);
+        } else {
+            releaseTroon(d.troonAtLink[link]);
+        }
+    }
+
+    d.troonAtLink[link] = NO_TROON;
+}
+
+// The platform troon has waited long enough and the link is free, found by findDepartures.
+void processPushPlatform(size_t link, size_t tick) {
+    dynamicLinkState &d = graphStateDynamic;
+    d.platformCounter[link] = 0;
+    d.troonAtLink[link] = d.troonAtPlatform[link];
+    troonPool[d.troonAtLink[link]].location = LINK;
+    d.troonAtPlatform[link] = NO_TROON;
+
+    announceDeparture(link, tick + d.distance[link]);
+}
+
+// Lookahead mode: the troon that just entered the link will reach the next waiting area at arrivalTick. If that one is
+// on another rank, a copy is sent ahead right away, the local troon stays on the link (and in the output) until then.
+void announceDeparture(size_t link, size_t arrivalTick) {
+    dynamicLinkState &d = graphStateDynamic;
+    if (!useLookahead) return;
+
+    size_t nextLink = nextLinkOnLine(graphState[link], troonPool[d.troonAtLink[link]].line);
+    if (startLink <= static_cast<int>(nextLink) && static_cast<int>(nextLink) < endLink) return;
+
+    Troon handoff = troonPool[d.troonAtLink[link]];
+    handoff.arrivalTime = arrivalTick;
+    handoff.currentLink = nextLink;
+    ThreadBuffers *buffers = currentThreadBuffers();
+    int nextNode = linkOwner[nextLink];
+    auto &buffer = buffers != nullptr ? buffers->handoffs[nextNode] : troons_buffer_to_send[nextNode];
+    buffer.push_back(packHandoff(handoff));
+}
+
+// Troons already on a link when a lookahead run starts (after fastForward) have not been announced yet.
+void announceInFlightTroons(size_t firstTick) {
+    dynamicLinkState &d = graphStateDynamic;
+    for (int i = startLink; i < endLink; i++) {
+        if (d.troonAtLink[i] == NO_TROON) continue;
+
+        size_t arrivalTick = useEventEngine ? d.linkArrivalTick[i] :
+                             firstTick - 1 - d.linkDistance[i] + d.distance[i];
+        announceDeparture(i, arrivalTick);
+    }
+
+    exchangeTroons(firstTick);
+}
+
+void deliverPendingArrivals(size_t tick) {
+    auto it = pendingArrivals.find(tick);
+    if (it == pendingArrivals.end()) return;
+
+    for (TroonIndex troon: it->second) {
+        pushToWaitingArea(troonPool[troon].currentLink, troon);
+    }
+    pendingArrivals.erase(it);
+}
+
+bool isLookaheadWindowEnd(size_t firstTick, size_t t) {
+    return (t - firstTick + 1) % lookahead == 0;
+}
+
+// A troon announced at tick p arrives at p + distance, so when every link handing troons to another rank is at least
+// `lookahead` long, what is sent during a window of that many ticks is needed in the next window at the earliest.
+// Without any such link nothing ever has to be exchanged.
+void computeLookahead() {
+    unsigned long long localMin = ULLONG_MAX;
+
+    forEachLineStep([&](size_t, size_t link, size_t next) {
+        if (linkOwner[link] == myid && linkOwner[next] != myid) {
+            localMin = min(localMin, static_cast<unsigned long long>(graphState[link].distance));
+        }
+    });
+
+    unsigned long long globalMin;
+    MPI_Allreduce(&localMin, &globalMin, 1, MPI_UNSIGNED_LONG_LONG, MPI_MIN, MPI_COMM_WORLD);
+    lookahead = globalMin == ULLONG_MAX ? SIZE_MAX : max(1ULL, globalMin);
+}
+
+void processWaitingArea(size_t link) {
+    dynamicLinkState &d = graphStateDynamic;
+    bool hasTroonAtPlatform = d.troonAtPlatform[link] != NO_TROON;
+    if (d.waitingArea[link].empty() || hasTroonAtPlatform) {
+        return;
+    }
+
+    TroonIndex troon = d.waitingArea[link].top();
+    troonPool[troon].location = PLATFORM;
+    d.troonAtPlatform[link] = troon;
+    d.waitingArea[link].pop();
+}
+
+void processPushPlatforms(size_t tick) {
+    runThreadPhase([tick](int begin, int end) {
+        vector<int> &slow = phaseSlowLinks();
+        slow.clear();
+        sweepKernels->findDepartures(begin, end, slow);
+        for (int link: slow) {
+            processPushPlatform(link, tick);
+        }
+    });
+    mergeThreadBuffers();
+}
+
+void processWaitingAreas() {
+    runThreadPhase([](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            processWaitingArea(i);
+        }
+    });
+}
+
+void processWaitPlatforms() {
+    runThreadPhase([](int begin, int end) {
+        sweepKernels->countPlatforms(begin, end);
+    });
+}
+
+// The sweep engine's per-link phases as kernels over [begin, end) of the link arrays. They update the counters of
+// every link and append the few links that need the scalar slow path to `slow`: the links whose troon reached the end
+// (updateLinks) and the links whose platform troon may enter the link (findDepartures). selectSweepKernels picks the
+// widest variant the CPU supports.
+void updateLinksScalar(int begin, int end, vector<int> &slow) {
+    dynamicLinkState &d = graphStateDynamic;
+    const TroonIndex *troonAtLink = d.troonAtLink.data();
+    const size_t *distance = d.distance.data();
+    size_t *linkCounter = d.linkCounter.data();
+    size_t *linkDistance = d.linkDistance.data();
+    // every link is written to the end of slow, which only advances past the arriving ones
+    size_t count = slow.size();
+    slow.resize(count + (end - begin));
+    int *out = slow.data() + count;
+    for (int i = begin; i < end; i++) {
+        size_t isFree = troonAtLink[i] == NO_TROON;
+        size_t isArriving = (1 - isFree) & (linkDistance[i] + 1 == distance[i]);
+        // x - 1 is all ones when x is 0, masking instead of branching
+        linkCounter[i] = (linkCounter[i] + isFree) & (isArriving - 1);
+        linkDistance[i] = (linkDistance[i] + 1) & ((isFree | isArriving) - 1);
+        *out = i;
+        out += isArriving;
+    }
+    slow.resize(out - slow.data());
+}
+
+void findDeparturesScalar(int begin, int end, vector<int> &slow) {
+    dynamicLinkState &d = graphStateDynamic;
+    for (int i = begin; i < end; i++) {
+        if (d.troonAtPlatform[i] != NO_TROON && d.platformCounter[i] >= d.popularity[i] + 2 &&
+            d.troonAtLink[i] == NO_TROON && d.linkCounter[i] >= 1) {
+            slow.push_back(i);
+        }
+    }
+}
+
+void countPlatformsScalar(int begin, int end) {
+    dynamicLinkState &d = graphStateDynamic;
+    for (int i = begin; i < end; i++) {
+        d.platformCounter[i] += d.troonAtPlatform[i] != NO_TROON;
+    }
+}
+
+#ifdef HAS_X86_KERNELS
+void appendMaskedLinks(unsigned mask, int base, vector<int> &slow) {
+    while (mask != 0) {
+        slow.push_back(base + __builtin_ctz(mask));
+        mask &= mask - 1;
+    }
+}
+
+// 4 links per step. The counters stay far below 2^63, so the signed 64-bit compares are safe.
+__attribute__((target("avx2"))) void updateLinksAvx2(int begin, int end, vector<int> &slow) {
+    dynamicLinkState &d = graphStateDynamic;
+    const __m256i noTroon = _mm256_set1_epi64x(NO_TROON);
+    const __m256i one = _mm256_set1_epi64x(1);
+    int i = begin;
+    for (; i + 4 <= end; i += 4) {
+        __m256i troon = _mm256_cvtepu32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i *>(&d.troonAtLink[i])));
+        __m256i *linkCounter = reinterpret_cast<__m256i *>(&d.linkCounter[i]);
+        __m256i *linkDistance = reinterpret_cast<__m256i *>(&d.linkDistance[i]);
+        __m256i distance = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&d.distance[i]));
+
+        __m256i isFree = _mm256_cmpeq_epi64(troon, noTroon);
+        __m256i next = _mm256_add_epi64(_mm256_loadu_si256(linkDistance), one);
+        __m256i isArriving = _mm256_andnot_si256(isFree, _mm256_cmpeq_epi64(next, distance));
+
+        // isFree is -1 on free links
+        __m256i counter = _mm256_sub_epi64(_mm256_loadu_si256(linkCounter), isFree);
+        _mm256_storeu_si256(linkCounter, _mm256_andnot_si256(isArriving, counter));
+        _mm256_storeu_si256(linkDistance, _mm256_andnot_si256(_mm256_or_si256(isFree, isArriving), next));
+
+        appendMaskedLinks(static_cast<unsigned>(_mm256_movemask_pd(_mm256_castsi256_pd(isArriving))), i, slow);
+    }
+    updateLinksScalar(i, end, slow);
+}
+
+__attribute__((target("avx2"))) void findDeparturesAvx2(int begin, int end, vector<int> &slow) {
+    dynamicLinkState &d = graphStateDynamic;
+    const __m256i noTroon = _mm256_set1_epi64x(NO_TROON);
+    const __m256i two = _mm256_set1_epi64x(2);
+    const __m256i zero = _mm256_setzero_si256();
+    int i = begin;
+    for (; i + 4 <= end; i += 4) {
+        __m256i atPlatform = _mm256_cvtepu32_epi64(
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(&d.troonAtPlatform[i])));
+        __m256i atLink = _mm256_cvtepu32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i *>(&d.troonAtLink[i])));
+        __m256i platformCounter = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&d.platformCounter[i]));
+        __m256i linkCounter = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&d.linkCounter[i]));
+        __m256i wait = _mm256_add_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(&d.popularity[i])), two);
+
+        __m256i isLinkFree = _mm256_and_si256(_mm256_cmpeq_epi64(atLink, noTroon),
+                                              _mm256_cmpgt_epi64(linkCounter, zero));
+        __m256i isBlocked = _mm256_or_si256(_mm256_cmpeq_epi64(atPlatform, noTroon),
+                                            _mm256_cmpgt_epi64(wait, platformCounter));
+        __m256i isDeparting = _mm256_andnot_si256(isBlocked, isLinkFree);
+
+        appendMaskedLinks(static_cast<unsigned>(_mm256_movemask_pd(_mm256_castsi256_pd(isDeparting))), i, slow);
+    }
+    findDeparturesScalar(i, end, slow);
+}
+
+__attribute__((target("avx2"))) void countPlatformsAvx2(int begin, int end) {
+    dynamicLinkState &d = graphStateDynamic;
+    const __m256i noTroon = _mm256_set1_epi64x(NO_TROON);
+    const __m256i one = _mm256_set1_epi64x(1);
+    int i = begin;
+    for (; i + 4 <= end; i += 4) {
+        __m256i atPlatform = _mm256_cvtepu32_epi64(
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(&d.troonAtPlatform[i])));
+        __m256i *platformCounter = reinterpret_cast<__m256i *>(&d.platformCounter[i]);
+        // + 1 on occupied platforms, + 1 - 1 on empty ones
+        __m256i step = _mm256_add_epi64(one, _mm256_cmpeq_epi64(atPlatform, noTroon));
+        _mm256_storeu_si256(platformCounter, _mm256_add_epi64(_mm256_loadu_si256(platformCounter), step));
+    }
+    countPlatformsScalar(i, end);
+}
+
+// 8 links per step, the lanes are selected with mask registers.
+__attribute__((target("avx512f"))) __m512i widenTroonIndices(__m256i indices) {
+    // the unmasked conversion trips -Wmaybe-uninitialized in GCC 12's headers
+    return _mm512_maskz_cvtepu32_epi64(0xff, indices);
+}
+
+__attribute__((target("avx512f"))) void updateLinksAvx512(int begin, int end, vector<int> &slow) {
+    dynamicLinkState &d = graphStateDynamic;
+    const __m512i noTroon = _mm512_set1_epi64(NO_TROON);
+    const __m512i one = _mm512_set1_epi64(1);
+    int i = begin;
+    for (; i + 8 <= end; i += 8) {
+        __m512i troon = widenTroonIndices(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(&d.troonAtLink[i])));
+        __m512i distance = _mm512_loadu_si512(&d.distance[i]);
+        __m512i counter = _mm512_loadu_si512(&d.linkCounter[i]);
+        __m512i next = _mm512_add_epi64(_mm512_loadu_si512(&d.linkDistance[i]), one);
+
+        __mmask8 isFree = _mm512_cmpeq_epu64_mask(troon, noTroon);
+        __mmask8 isArriving = _mm512_mask_cmpeq_epu64_mask(static_cast<__mmask8>(~isFree), next, distance);
+
+        counter = _mm512_mask_add_epi64(counter, isFree, counter, one);
+        _mm512_storeu_si512(&d.linkCounter[i], _mm512_maskz_mov_epi64(static_cast<__mmask8>(~isArriving), counter));
+        _mm512_storeu_si512(&d.linkDistance[i],
+                            _mm512_maskz_mov_epi64(static_cast<__mmask8>(~(isFree | isArriving)), next));
+
+        appendMaskedLinks(isArriving, i, slow);
+    }
+    updateLinksScalar(i, end, slow);
+}
+
+__attribute__((target("avx512f"))) void findDeparturesAvx512(int begin, int end, vector<int> &slow) {
+    dynamicLinkState &d = graphStateDynamic;
+    const __m512i noTroon = _mm512_set1_epi64(NO_TROON);
+    const __m512i two = _mm512_set1_epi64(2);
+    const __m512i one = _mm512_set1_epi64(1);
+    int i = begin;
+    for (; i + 8 <= end; i += 8) {
+        __m512i atPlatform = widenTroonIndices(
+                _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&d.troonAtPlatform[i])));
+        __m512i atLink = widenTroonIndices(
+                _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&d.troonAtLink[i])));
+        __m512i wait = _mm512_add_epi64(_mm512_loadu_si512(&d.popularity[i]), two);
+
+        __mmask8 isDeparting = _mm512_cmpneq_epu64_mask(atPlatform, noTroon);
+        isDeparting = _mm512_mask_cmpeq_epu64_mask(isDeparting, atLink, noTroon);
+        isDeparting = _mm512_mask_cmpge_epu64_mask(isDeparting, _mm512_loadu_si512(&d.platformCounter[i]), wait);
+        isDeparting = _mm512_mask_cmpge_epu64_mask(isDeparting, _mm512_loadu_si512(&d.linkCounter[i]), one);
+
+        appendMaskedLinks(isDeparting, i, slow);
+    }
+    findDeparturesScalar(i, end, slow);
+}
+
+__attribute__((target("avx512f"))) void countPlatformsAvx512(int begin, int end) {
+    dynamicLinkState &d = graphStateDynamic;
+    const __m512i noTroon = _mm512_set1_epi64(NO_TROON);
+    const __m512i one = _mm512_set1_epi64(1);
+    int i = begin;
+    for (; i + 8 <= end; i += 8) {
+        __m512i atPlatform = widenTroonIndices(
+                _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&d.troonAtPlatform[i])));
+        __m512i counter = _mm512_loadu_si512(&d.platformCounter[i]);
+        __mmask8 isOccupied = _mm512_cmpneq_epu64_mask(atPlatform, noTroon);
+        _mm512_storeu_si512(&d.platformCounter[i], _mm512_mask_add_epi64(counter, isOccupied, counter, one));
+    }
+    countPlatformsScalar(i, end);
+}
+#endif
+
+const SweepKernels scalarKernels = {"scalar", updateLinksScalar, findDeparturesScalar, countPlatformsScalar};
+#ifdef HAS_X86_KERNELS
+const SweepKernels avx2Kernels = {"avx2", updateLinksAvx2, findDeparturesAvx2, countPlatformsAvx2};
+const SweepKernels avx512Kernels = {"avx512", updateLinksAvx512, findDeparturesAvx512, countPlatformsAvx512};
+#endif
+
+// The kernel variants this CPU can run, narrowest first.
+vector<const SweepKernels *> supportedSweepKernels() {
+    vector<const SweepKernels *> kernels = {&scalarKernels};
+#ifdef HAS_X86_KERNELS
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.push_back(&avx2Kernels);
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+        kernels.push_back(&avx512Kernels);
+    }
+#endif
+    return kernels;
+}
+
+// name is "auto" for the widest supported variant, returns false if the requested one is not available.
+bool selectSweepKernels(const string &name) {
+    vector<const SweepKernels *> kernels = supportedSweepKernels();
+    if (name == "auto") {
+        sweepKernels = kernels.back();
+        return true;
+    }
+
+    for (const SweepKernels *k: kernels) {
+        if (name == k->name) {
+            sweepKernels = k;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Links per nanosecond of each kernel variant on a synthetic state of BENCH_KERNEL_LINKS links, a third of them
+// carrying a troon, with the distances and popularities of the input's links repeated.
+void runKernelBenchmark() {
+    const int iterations = 2000;
+    const int numLinks = BENCH_KERNEL_LINKS;
+
+    vector<staticLinkState> links = graphState;
+    dynamicLinkState &d = graphStateDynamic;
+    d = dynamicLinkState();
+    d.distance.resize(numLinks);
+    d.popularity.resize(numLinks);
+    for (int i = 0; i < numLinks; i++) {
+        d.distance[i] = max<size_t>(1, links[i % links.size()].distance);
+        d.popularity[i] = links[i % links.size()].popularity;
+    }
+
+    for (const SweepKernels *k: supportedSweepKernels()) {
+        d.platformCounter.assign(numLinks, 0);
+        d.linkCounter.assign(numLinks, 1);
+        d.linkDistance.assign(numLinks, 0);
+        d.troonAtPlatform.assign(numLinks, NO_TROON);
+        d.troonAtLink.assign(numLinks, NO_TROON);
+        for (int i = 0; i < numLinks; i += 3) {
+            d.troonAtLink[i] = i;
+            d.troonAtPlatform[i + 1 < numLinks ? i + 1 : i] = i;
+        }
+
+        vector<int> slow;
+        slow.reserve(numLinks);
+        double start = MPI_Wtime();
+        for (int r = 0; r < iterations; r++) {
+            slow.clear();
+            k->updateLinks(0, numLinks, slow);
+            slow.clear();
+            k->findDepartures(0, numLinks, slow);
+            k->countPlatforms(0, numLinks);
+        }
+        double elapsed = MPI_Wtime() - start;
+
+        if (myid == ORIGINAL_PROC) {
+            cout << "kernels " << k->name << ", links/ns: "
+                 << static_cast<double>(numLinks) * iterations / (elapsed * 1e9) << endl;
+        }
+    }
+}
+
+void initialization(const vector<string> &station_names, const vector<size_t> &popularities,
+                    vector<size_t> green_station_id, vector<size_t> yellow_station_id,
+                    vector<size_t> blue_station_id, const line_edges &edges) {
+    stationIdNameMapping = station_names;
+
+    // every pair of consecutive stations gives at most two links
+    LinkTable links;
+    initLinkTable(links, 2 * (green_station_id.size() + yellow_station_id.size() + blue_station_id.size()));
+
+    // initialize static link mapping
+    // populate line green forward direction
+    populateStaticData(popularities, edges, green_station_id, links);
+    populateStaticData(popularities, edges, yellow_station_id, links);
+    populateStaticData(popularities, edges, blue_station_id, links);
+
+    // reverse mapping
+    std::reverse(green_station_id.begin(), green_station_id.end());
+    std::reverse(yellow_station_id.begin(), yellow_station_id.end());
+    std::reverse(blue_station_id.begin(), blue_station_id.end());
+
+    // populate reverse mapping
+    populateStaticData(popularities, edges, green_station_id, links);
+    populateStaticData(popularities, edges, yellow_station_id, links);
+    populateStaticData(popularities, edges, blue_station_id, links);
+
+    // assemble the graph
+    vector<size_t> *station_ids[] = {&green_station_id, &yellow_station_id, &blue_station_id};
+    size_t lines[] = {GREEN, YELLOW, BLUE};
+    for (int l = 0; l < 3; l++) {
+        assembleLine(*station_ids[l], lines[l], links, true);
+        std::reverse(station_ids[l]->begin(), station_ids[l]->end());
+        assembleLine(*station_ids[l], lines[l], links, false);
+    }
+}
+
+// Links every link of the line to its successor. The station ids run against the line's forward direction when
+// isReverse is set, so the link turning around at the last station is the forward terminal.
+void assembleLine(const vector<size_t> &station_id, size_t line, const LinkTable &links, bool isReverse) {
+    size_t currentLink, nextLink, nextTwoStation;
+    for (size_t i = 0; i + 1 < station_id.size(); i++) {
+        size_t currentStation = station_id[i];
+        size_t nextStation = station_id[i + 1];
+        currentLink = findLink(links, currentStation, nextStation);
+
+        if (i == station_id.size() - 2) { // terminal
+            nextLink = findLink(links, nextStation, currentStation);
+            lineTerminal(line, isReverse) = nextLink;
+        } else {
+            nextTwoStation = station_id[i + 2];
+            nextLink = findLink(links, nextStation, nextTwoStation);
+        }
+
+        setNextLinkOnLine(graphState[currentLink], line, nextLink);
+    }
+}
+
+size_t &lineTerminal(size_t line, bool isForward) {
+    switch (line) {
+        case GREEN:
+            return isForward ? terminalGreenForward : terminalGreenReverse;
+        case YELLOW:
+            return isForward ? terminalYellowForward : terminalYellowReverse;
+        default:
+            return isForward ? terminalBlueForward : terminalBlueReverse;
+    }
+}
+
+void setNextLinkOnLine(staticLinkState &s, size_t line, size_t next) {
+    switch (line) {
+        case GREEN:
+            s.nextLinkGreen = next;
+            break;
+        case YELLOW:
+            s.nextLinkYellow = next;
+            break;
+        default:
+            s.nextLinkBlue = next;
+            break;
+    }
+}
+
+void populateStaticData(
+        const vector<size_t> &popularities,
+        const line_edges &edges,
+        const vector<size_t> &station_id,
+        LinkTable &links
+) {
+    for (size_t i = 0; i + 1 < station_id.size(); i++) {
+        size_t currentStation = station_id[i];
+        size_t nextStation = station_id[i + 1];
+
+        if (findLink(links, currentStation, nextStation) == EMPTY_SLOT) {
+            staticLinkState s = {};
+            s.popularity = popularities[currentStation];
+            s.srcId = currentStation;
+            s.destId = nextStation;
+            s.distance = lineEdgeDistance(edges, currentStation, nextStation);
+            s.id = graphCounter++;
+
+            insertLink(links, currentStation, nextStation, s.id);
+            graphState.push_back(s);
+        }
+    }
+}
+
+// Power of two with at least twice as many slots as entries.
+size_t tableCapacity(size_t entries) {
+    size_t capacity = 16;
+    while (capacity < 2 * entries) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+void buildStationNameTable(const vector<string> &names, StationNameTable &table) {
+    table.names = &names;
+    table.slots.assign(tableCapacity(names.size()), EMPTY_SLOT);
+    size_t mask = table.slots.size() - 1;
+    for (size_t i = 0; i < names.size(); i++) {
+        size_t slot = std::hash<string_view>()(names[i]) & mask;
+        while (table.slots[slot] != EMPTY_SLOT) {
+            slot = (slot + 1) & mask;
+        }
+        table.slots[slot] = static_cast<uint32_t>(i);
+    }
+}
+
+// Returns EMPTY_SLOT for an unknown name.
+size_t findStation(const StationNameTable &table, string_view name) {
+    size_t mask = table.slots.size() - 1;
+    size_t slot = std::hash<string_view>()(name) & mask;
+    while (table.slots[slot] != EMPTY_SLOT) {
+        if ((*table.names)[table.slots[slot]] == name) {
+            return table.slots[slot];
+        }
+        slot = (slot + 1) & mask;
+    }
+    return EMPTY_SLOT;
+}
+
+size_t linkSlot(uint64_t key, size_t mask) {
+    return static_cast<size_t>((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask; // Fibonacci hashing
+}
+
+void initLinkTable(LinkTable &table, size_t maxLinks) {
+    size_t capacity = tableCapacity(maxLinks);
+    table.keys.assign(capacity, UINT64_MAX);
+    table.links.assign(capacity, EMPTY_SLOT);
+}
+
+// Returns EMPTY_SLOT if there is no link from src to dest.
+size_t findLink(const LinkTable &table, size_t src, size_t dest) {
+    uint64_t key = static_cast<uint64_t>(src) << 32 | dest;
+    size_t mask = table.keys.size() - 1;
+    for (size_t slot = linkSlot(key, mask); table.keys[slot] != UINT64_MAX; slot = (slot + 1) & mask) {
+        if (table.keys[slot] == key) {
+            return table.links[slot];
+        }
+    }
+    return EMPTY_SLOT;
+}
+
+void insertLink(LinkTable &table, size_t src, size_t dest, size_t link) {
+    uint64_t key = static_cast<uint64_t>(src) << 32 | dest;
+    size_t mask = table.keys.size() - 1;
+    size_t slot = linkSlot(key, mask);
+    while (table.keys[slot] != UINT64_MAX) {
+        slot = (slot + 1) & mask;
+    }
+    table.keys[slot] = key;
+    table.links[slot] = static_cast<uint32_t>(link);
+}
+
+// Relabels the links so that every rank owns one contiguous id range made of whole stretches of the lines.
+// Each line is walked as a cycle (one direction, then back) from one of its terminals, and every link gets the next id
+// the first time a walk reaches it. A troon's next link therefore usually has the next id. The sequence is
+// cut into nprocs ranges of roughly equal weight, so a troon only changes rank at the few cut points and where two
+// lines share a link. The weight is 1 for the per-tick sweep, plus the troons expected on the link. A troon of a line
+// spends about popularity + 2 + distance ticks on each link of its cycle, so the link gets the number of trains on the
+// line times its share of the line's cycle time.
+void partitionLinks(size_t num_green_trains, size_t num_yellow_trains, size_t num_blue_trains) {
+    size_t numLinks = graphState.size();
+    vector<bool> isPlaced(numLinks, false);
+    vector<size_t> order;
+    order.reserve(numLinks);
+
+    size_t trains[3];
+    trains[GREEN] = num_green_trains;
+    trains[YELLOW] = num_yellow_trains;
+    trains[BLUE] = num_blue_trains;
+
+    auto linkTime = [](size_t link) {
+        return static_cast<double>(graphState[link].popularity + 2 + graphState[link].distance);
+    };
+
+    double cycleTime[3] = {0, 0, 0};
+    forEachLineStep([&](size_t line, size_t link, size_t) {
+        cycleTime[line] += linkTime(link);
+    });
+
+    vector<double> weight(numLinks, 1.0);
+    forEachLineStep([&](size_t line, size_t link, size_t) {
+        weight[link] += static_cast<double>(trains[line]) * linkTime(link) / cycleTime[line];
+        if (!isPlaced[link]) {
+            isPlaced[link] = true;
+            order.push_back(link);
+        }
+    });
+
+    for (size_t i = 0; i < numLinks; i++) { // not on any line, should not happen
+        if (!isPlaced[i]) {
+            order.push_back(i);
+        }
+    }
+
+    double totalWeight = 0;
+    for (double w: weight) {
+        totalWeight += w;
+    }
+
+    partitionStart.assign(nprocs + 1, static_cast<int>(numLinks));
+    partitionStart[0] = 0;
+    double prefix = 0;
+    int rank = 1;
+    for (size_t k = 0; k < numLinks && rank < nprocs; k++) {
+        while (rank < nprocs && prefix >= totalWeight * rank / nprocs) {
+            partitionStart[rank++] = static_cast<int>(k);
+        }
+        prefix += weight[order[k]];
+    }
+
+    vector<size_t> newId(numLinks);
+    for (size_t k = 0; k < numLinks; k++) {
+        newId[order[k]] = k;
+    }
+
+    vector<staticLinkState> relabeled(numLinks);
+    for (size_t i = 0; i < numLinks; i++) {
+        staticLinkState s = graphState[i];
+        s.id = newId[i];
+        s.nextLinkGreen = newId[s.nextLinkGreen];
+        s.nextLinkYellow = newId[s.nextLinkYellow];
+        s.nextLinkBlue = newId[s.nextLinkBlue];
+        relabeled[s.id] = s;
+    }
+    graphState.swap(relabeled);
+
+    terminalGreenForward = newId[terminalGreenForward];
+    terminalGreenReverse = newId[terminalGreenReverse];
+    terminalYellowForward = newId[terminalYellowForward];
+    terminalYellowReverse = newId[terminalYellowReverse];
+    terminalBlueForward = newId[terminalBlueForward];
+    terminalBlueReverse = newId[terminalBlueReverse];
+
+    linkOwner.assign(numLinks, 0);
+    for (int r = 0; r < nprocs; r++) {
+        for (int i = partitionStart[r]; i < partitionStart[r + 1]; i++) {
+            linkOwner[i] = r;
+        }
+    }
+
+#ifdef DEBUG
+    size_t crossRankHandoffs = 0;
+    for (auto &c: graphState) {
+        for (size_t line: {GREEN, YELLOW, BLUE}) {
+            size_t next = nextLinkOnLine(c, line);
+            if (next != c.id && linkOwner[next] != linkOwner[c.id]) crossRankHandoffs++;
+        }
+    }
+    cout << "cross-rank successor edges (upper bound): " << crossRankHandoffs << endl;
+#endif
+}
+
+// The old split: equal numbers of links by id, kept for comparison.
+void partitionLinksByBlock() {
+    int numLinks = static_cast<int>(graphState.size());
+    int linksPerNode = (numLinks + nprocs - 1) / nprocs;
+
+    partitionStart.assign(nprocs + 1, numLinks);
+    linkOwner.assign(numLinks, 0);
+    for (int r = 0; r < nprocs; r++) {
+        partitionStart[r] = min(numLinks, r * linksPerNode);
+    }
+    for (int i = 0; i < numLinks; i++) {
+        linkOwner[i] = i / linksPerNode;
+    }
+}
+
+// Calls step(line, link, next) for every link of the green, yellow and blue cycles in that order, each cycle starting
+// at the forward terminal of its line, next being the link a troon on link moves to.
+template<typename Step>
+void forEachLineStep(Step step) {
+    size_t terminals[] = {terminalGreenForward, terminalYellowForward, terminalBlueForward};
+    size_t lines[] = {GREEN, YELLOW, BLUE};
+    for (int l = 0; l < 3; l++) {
+        size_t link = terminals[l];
+        do {
+            size_t next = nextLinkOnLine(graphState[link], lines[l]);
+            step(lines[l], link, next);
+            link = next;
+        } while (link != terminals[l]);
+    }
+}
+
+size_t nextLinkOnLine(const staticLinkState &s, size_t line) {
+    switch (line) {
+        case GREEN: // G
+            return s.nextLinkGreen;
+        case YELLOW: // Y
+            return s.nextLinkYellow;
+        case BLUE: // B
+            return s.nextLinkBlue;
+        default:
+            return -1;
+    }
+}
+
+// The slot printTroons fills next, waits while the writer still has both.
+OutputSlot &acquireOutputSlot() {
+    checkOutputError();
+    if (!useWriterThread) {
+        return outputSlots[0];
     }
 
-    if (blueTroonCounter < num_blue_trains) {
-        if (isBlueMine) {
-            auto *troon = new Troon{
-                    t,
-                    troonIdCounter,
-                    graphStateDynamic[terminalBlueForward]->state.srcId,
-                    graphStateDynamic[terminalBlueForward]->state.destId,
-                    WAITING_AREA,
-                    BLUE,
-                    terminalBlueForward
-            };
+    std::unique_lock<std::mutex> lock(outputMutex);
+    outputChanged.wait(lock, [] { return filledSlots - writtenSlots < OUTPUT_SLOTS; });
+    return outputSlots[filledSlots % OUTPUT_SLOTS];
+}
 
-            graphStateDynamic[terminalBlueForward]->waitingArea.push(troon);
-        }
+void publishOutputSlot() {
+    if (!useWriterThread) {
+        writeOutputSlot(outputSlots[0]);
+        return;
+    }
 
-        blueTroonCounter++;
-        troonIdCounter++;
+    {
+        std::lock_guard<std::mutex> lock(outputMutex);
+        filledSlots++;
     }
+    outputChanged.notify_all();
+}
 
-    if (blueTroonCounter < num_blue_trains) {
-        if (isBlueReverseMine) {
-            auto *troon = new Troon{
-                    t,
-                    troonIdCounter,
-                    graphStateDynamic[terminalBlueReverse]->state.srcId,
-                    graphStateDynamic[terminalBlueReverse]->state.destId,
-                    WAITING_AREA,
-                    BLUE,
-                    terminalBlueReverse
-            };
+// Merges the sorted runs of the slot by (sortKey, rank) and writes the tick's line to stdout.
+void writeOutputSlot(const OutputSlot &slot) {
+    if (!trajectoryPath.empty()) {
+        writeTrajectorySlot(slot);
+        return;
+    }
+
+    int runs = static_cast<int>(slot.counts.size());
+    vector<size_t> position(runs);
+    vector<size_t> runEnd(runs);
+    size_t offset = 0;
+    for (int i = 0; i < runs; i++) {
+        position[i] = offset;
+        offset += slot.counts[i];
+        runEnd[i] = offset;
+    }
 
-            graphStateDynamic[terminalBlueReverse]->waitingArea.push(troon);
+    using MergeCursor = pair<uint64_t, int>;
+    priority_queue<MergeCursor, vector<MergeCursor>, std::greater<MergeCursor>> heads;
+    vector<Troon> head(runs);
+    for (int i = 0; i < runs; i++) {
+        if (position[i] < runEnd[i]) {
+            head[i] = unpackSnapshot(slot.snapshots[position[i]]);
+            heads.emplace(head[i].sortKey, i);
         }
+    }
 
-        blueTroonCounter++;
-        troonIdCounter++;
+    char *line = reserveOutput(0, slot.snapshots.size());
+    char *out = std::to_chars(line, line + 20, slot.tick).ptr;
+    *out++ = ':';
+    *out++ = ' ';
+    while (!heads.empty()) {
+        int i = heads.top().second;
+        heads.pop();
+
+        out = formatTroon(out, head[i]);
+        if (++position[i] < runEnd[i]) {
+            head[i] = unpackSnapshot(slot.snapshots[position[i]]);
+            heads.emplace(head[i].sortKey, i);
+        }
     }
+    *out++ = '\n';
+
+    cout.write(line, out - line);
+    cout.flush();
 }
 
-void processLink(dynamicLinkState *dstate, size_t tick) {
-    if (dstate->troonAtLink == nullptr) {
-        dstate->linkCounter++;
-        return;
+void openTrajectory() {
+    string names;
+    for (auto &name: stationIdNameMapping) {
+        names += name;
+        names += '\0';
     }
 
-    if (dstate->linkDistance == (dstate->state.distance - 1)) {
-        Troon *currTroon = dstate->troonAtLink;
-        currTroon->arrivalTime = tick;
-        currTroon->location = WAITING_AREA;
-
-        size_t nextLink;
-
-        switch (currTroon->line) {
-            case GREEN: // G
-                nextLink = dstate->state.nextLinkGreen;
-                break;
-            case YELLOW: // Y
-                nextLink = dstate->state.nextLinkYellow;
-                break;
-            case BLUE: // B
-                nextLink = dstate->state.nextLinkBlue;
-                break;
-            default:
-                nextLink = -1;
-        }
-
-        currTroon->src = graphStateDynamic[nextLink]->state.srcId;
-        currTroon->dest = graphStateDynamic[nextLink]->state.destId;
-        currTroon->currentLink = nextLink;
-        if (startLink <= static_cast<int>(nextLink) && static_cast<int>(nextLink) < endLink) {
-            graphStateDynamic[nextLink]->waitingArea.push(currTroon);
-        } else {
-            // buffer it to be sent to other nodes
-            int nextNode = static_cast<int>(nextLink) / linksPerNode;
-            troons_buffer_to_send[nextNode].push_back(*currTroon);
-            delete currTroon;
-        }
+    TrajectoryHeader header = {};
+    memcpy(header.magic, TRAJECTORY_MAGIC, 8);
+    header.version = TRAJECTORY_VERSION;
+#ifdef TRAJECTORY_ZSTD
+    header.flags = TRAJECTORY_COMPRESSED;
+#endif
+    header.numStations = stationIdNameMapping.size();
+    header.numLinks = graphState.size();
+    header.namesSize = names.size();
+
+    vector<uint32_t> links;
+    links.reserve(2 * graphState.size());
+    for (const staticLinkState &s: graphState) {
+        links.push_back(static_cast<uint32_t>(s.srcId));
+        links.push_back(static_cast<uint32_t>(s.destId));
+    }
 
-        dstate->linkCounter = 0;
-        dstate->linkDistance = 0;
-        dstate->troonAtLink = nullptr;
-    } else {
-        dstate->linkDistance++;
+    trajectoryFile.open(trajectoryPath, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+    trajectoryFile.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    trajectoryFile.write(reinterpret_cast<const char *>(links.data()),
+                         static_cast<std::streamsize>(links.size() * sizeof(uint32_t)));
+    trajectoryFile.write(names.data(), static_cast<std::streamsize>(names.size()));
+    if (!trajectoryFile) {
+        std::cerr << "Failed to write " << trajectoryPath << '\n';
+        MPI_Abort(MPI_COMM_WORLD, 2);
     }
+    trajectoryStates.clear();
 }
 
-void processPushPlatform(dynamicLinkState *dstate) {
-    size_t maxCounter = dstate->state.popularity + 2;
-    bool isReadyToGo = dstate->platformCounter >= maxCounter;
-    bool isLinkSafeToEnter = dstate->troonAtLink == nullptr && dstate->linkCounter >= 1;
+// Every troon spawned so far is printed, so the slot holds exactly the ids [0, number of snapshots).
+void writeTrajectorySlot(const OutputSlot &slot) {
+    size_t known = trajectoryStates.size();
+    size_t total = slot.snapshots.size();
+    tickStates.resize(total);
+    tickLines.resize(total);
+    for (const TroonSnapshot &snapshot: slot.snapshots) {
+        uint32_t link = snapshot.linkLineLocation >> 4;
+        tickStates[snapshot.id] = link << 2 | (snapshot.linkLineLocation & 3);
+        tickLines[snapshot.id] = static_cast<uint8_t>((snapshot.linkLineLocation >> 2) & 3);
+    }
+
+    trajectoryRecord.clear();
+    appendVarint(trajectoryRecord, slot.tick);
+    appendVarint(trajectoryRecord, total - known);
+    for (size_t id = known; id < total; id++) {
+        trajectoryRecord.push_back(tickLines[id]);
+        appendVarint(trajectoryRecord, tickStates[id]);
+    }
 
-    if (!isReadyToGo || !isLinkSafeToEnter || !dstate->troonAtPlatform) {
+    trajectoryChanges.clear();
+    size_t changed = 0;
+    size_t previous = 0;
+    for (size_t id = 0; id < known; id++) {
+        if (tickStates[id] == trajectoryStates[id]) continue;
+        appendVarint(trajectoryChanges, changed == 0 ? id : id - previous);
+        appendVarint(trajectoryChanges, tickStates[id]);
+        previous = id;
+        changed++;
+    }
+    appendVarint(trajectoryRecord, changed);
+    trajectoryRecord.insert(trajectoryRecord.end(), trajectoryChanges.begin(), trajectoryChanges.end());
+    trajectoryStates.swap(tickStates);
+
+    trajectoryFrame.clear();
+    appendVarint(trajectoryFrame, trajectoryRecord.size());
+#ifdef TRAJECTORY_ZSTD
+    size_t bound = ZSTD_compressBound(trajectoryRecord.size());
+    if (trajectoryCompressed.size() < bound) {
+        trajectoryCompressed.resize(bound);
+    }
+    size_t compressedSize = ZSTD_compress(trajectoryCompressed.data(), trajectoryCompressed.size(),
+                                          trajectoryRecord.data(), trajectoryRecord.size(), 1);
+    if (ZSTD_isError(compressedSize)) {
+        failOutput("Failed to compress tick " + std::to_string(slot.tick) + ": " + ZSTD_getErrorName(compressedSize));
         return;
     }
+    appendVarint(trajectoryFrame, compressedSize);
+    trajectoryFrame.insert(trajectoryFrame.end(), trajectoryCompressed.begin(),
+                           trajectoryCompressed.begin() + compressedSize);
+#else
+    trajectoryFrame.insert(trajectoryFrame.end(), trajectoryRecord.begin(), trajectoryRecord.end());
+#endif
+    trajectoryFile.write(reinterpret_cast<const char *>(trajectoryFrame.data()),
+                         static_cast<std::streamsize>(trajectoryFrame.size()));
+    if (!trajectoryFile) {
+        failOutput("Failed to write " + trajectoryPath);
+    }
+}
 
-    dstate->platformCounter = 0;
-    dstate->troonAtLink = dstate->troonAtPlatform;
-    dstate->troonAtLink->location = LINK;
-    dstate->troonAtPlatform = nullptr;
+// LEB128, 7 bits per byte, low bits first
+void appendVarint(vector<uint8_t> &bytes, uint64_t value) {
+    while (value >= 0x80) {
+        bytes.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    bytes.push_back(static_cast<uint8_t>(value));
 }
 
-void processWaitingArea(dynamicLinkState *dstate) {
-    bool hasTroonAtPlatform = dstate->troonAtPlatform != nullptr;
-    if (dstate->waitingArea.empty() || hasTroonAtPlatform) {
-        return;
+void runWriter() {
+    while (true) {
+        size_t next;
+        {
+            std::unique_lock<std::mutex> lock(outputMutex);
+            outputChanged.wait(lock, [] { return writtenSlots < filledSlots || isOutputClosed; });
+            if (writtenSlots == filledSlots) return; // closed and nothing left
+            next = writtenSlots;
+        }
+
+        writeOutputSlot(outputSlots[next % OUTPUT_SLOTS]);
+
+        {
+            std::lock_guard<std::mutex> lock(outputMutex);
+            writtenSlots++;
+        }
+        outputChanged.notify_all();
     }
+}
 
-    Troon *troon = dstate->waitingArea.top();
-    troon->location = PLATFORM;
-    dstate->troonAtPlatform = troon;
-    dstate->waitingArea.pop();
+// The writer only formats and writes, it never calls MPI.
+void startWriter() {
+    filledSlots = 0;
+    writtenSlots = 0;
+    isOutputClosed = false;
+    writerThread = std::thread(runWriter);
 }
 
-void processWaitPlatform(dynamicLinkState *dstate) {
-    if (dstate->troonAtPlatform != nullptr) {
-        dstate->platformCounter++;
+// Waits until every published tick is written.
+void stopWriter() {
+    if (writerThread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(outputMutex);
+            isOutputClosed = true;
+        }
+        outputChanged.notify_all();
+        writerThread.join();
     }
+    checkOutputError();
 }
 
-void initialization(size_t num_stations, const vector<string> &station_names, const vector<size_t> &popularities,
-                    const vector<string> &green_station_names, const vector<string> &yellow_station_names,
-                    const vector<string> &blue_station_names, const adjacency_matrix &mat) {// Create station mapping
-    for (size_t i = 0; i < num_stations; i++) {
-        const string &stationName = station_names[i];
-        stationNameIdMapping[stationName] = i;
-        stationIdNameMapping.push_back(stationName);
+void failOutput(const string &message) {
+    std::lock_guard<std::mutex> lock(outputMutex);
+    if (outputError.empty()) {
+        outputError = message;
     }
+}
 
-    std::vector<size_t> green_station_id;
-    std::vector<size_t> yellow_station_id;
-    std::vector<size_t> blue_station_id;
+// Main thread only, the writer must not call MPI.
+void checkOutputError() {
+    string message;
+    {
+        std::lock_guard<std::mutex> lock(outputMutex);
+        message = outputError;
+    }
+    if (!message.empty()) {
+        std::cerr << message << '\n';
+        MPI_Abort(MPI_COMM_WORLD, 2);
+    }
+}
 
-    convertStationNamesToId(green_station_names, green_station_id);
-    convertStationNamesToId(yellow_station_names, yellow_station_id);
-    convertStationNamesToId(blue_station_names, blue_station_id);
+// Writes the line of tick t to outputFile. Every spawned troon is printed, so the rank of a troon's sort key among
+// spawnedSortKeys is its position in the line. Rank r formats positions [n * r / nprocs, n * (r + 1) / nprocs): the
+// troons are sent to the ranks that format them, the byte offsets follow from a prefix sum of the slice lengths and all
+// slices are written in one collective call.
+void writeTroons(size_t t) {
+    std::sort(spawnedSortKeys.begin() + static_cast<ptrdiff_t>(sortedKeyCount), spawnedSortKeys.end());
+    std::inplace_merge(spawnedSortKeys.begin(), spawnedSortKeys.begin() + static_cast<ptrdiff_t>(sortedKeyCount),
+                       spawnedSortKeys.end());
+    sortedKeyCount = spawnedSortKeys.size();
+
+    auto positionOf = [](const Troon &troon) {
+        auto key = std::lower_bound(spawnedSortKeys.begin(), spawnedSortKeys.end(), troon.sortKey);
+        return static_cast<size_t>(key - spawnedSortKeys.begin());
+    };
+
+    size_t total = spawnedSortKeys.size();
+    vector<size_t> sliceStart(nprocs + 1);
+    for (int r = 0; r <= nprocs; r++) {
+        sliceStart[r] = total * r / nprocs;
+    }
 
-    std::map<std::pair<size_t, size_t>, size_t> tempLinkMapping;
-    // initialize static link mapping
-    // populate line green forward direction
-    populateStaticData(popularities, mat, green_station_id, tempLinkMapping);
-    populateStaticData(popularities, mat, yellow_station_id, tempLinkMapping);
-    populateStaticData(popularities, mat, blue_station_id, tempLinkMapping);
+    // printedTroons is sorted, so the troons for each rank are already contiguous and in rank order
+    vector<int> sendCounts(nprocs, 0);
+    vector<int> sendDisplacements(nprocs, 0);
+    int owner = 0;
+    for (size_t k = 0; k < printedTroons.size(); k++) {
+        size_t position = positionOf(printedTroons[k]);
+        while (position >= sliceStart[owner + 1]) {
+            sendDisplacements[++owner] = static_cast<int>(k);
+        }
+        sendCounts[owner]++;
+    }
+    for (int r = owner + 1; r < nprocs; r++) {
+        sendDisplacements[r] = static_cast<int>(printedTroons.size());
+    }
 
-    // reverse mapping
-    std::reverse(green_station_id.begin(), green_station_id.end());
-    std::reverse(yellow_station_id.begin(), yellow_station_id.end());
-    std::reverse(blue_station_id.begin(), blue_station_id.end());
+    vector<int> recvCounts(nprocs);
+    vector<int> recvDisplacements(nprocs);
+    MPI_Alltoall(sendCounts.data(), 1, MPI_INT, recvCounts.data(), 1, MPI_INT, MPI_COMM_WORLD);
+    int received = 0;
+    for (int r = 0; r < nprocs; r++) {
+        recvDisplacements[r] = received;
+        received += recvCounts[r];
+    }
 
-    // populate reverse mapping
-    populateStaticData(popularities, mat, green_station_id, tempLinkMapping);
-    populateStaticData(popularities, mat, yellow_station_id, tempLinkMapping);
-    populateStaticData(popularities, mat, blue_station_id, tempLinkMapping);
+    sliceSnapshots.resize(received);
+    MPI_Alltoallv(printedSnapshots.data(), sendCounts.data(), sendDisplacements.data(), mpi_snapshot_type,
+                  sliceSnapshots.data(), recvCounts.data(), recvDisplacements.data(), mpi_snapshot_type,
+                  MPI_COMM_WORLD);
 
-    // assemble the graph
-    assembleGreenLine(green_station_id, tempLinkMapping, true);
-    std::reverse(green_station_id.begin(), green_station_id.end());
-    assembleGreenLine(green_station_id, tempLinkMapping, false);
+    sliceTroons.resize(sliceStart[myid + 1] - sliceStart[myid]);
+    for (TroonSnapshot &snapshot: sliceSnapshots) {
+        Troon troon = unpackSnapshot(snapshot);
+        sliceTroons[positionOf(troon) - sliceStart[myid]] = troon;
+    }
 
-    assembleYellowLine(yellow_station_id, tempLinkMapping, true);
-    std::reverse(yellow_station_id.begin(), yellow_station_id.end());
-    assembleYellowLine(yellow_station_id, tempLinkMapping, false);
+    char *slice = reserveOutput(0, sliceTroons.size());
+    char *out = slice;
+    if (myid == ORIGINAL_PROC) {
+        out = std::to_chars(out, out + 20, t).ptr;
+        *out++ = ':';
+        *out++ = ' ';
+    }
+    for (Troon &troon: sliceTroons) {
+        out = formatTroon(out, troon);
+    }
+    if (myid == nprocs - 1) {
+        *out++ = '\n';
+    }
 
-    assembleBlueLine(blue_station_id, tempLinkMapping, true);
-    std::reverse(blue_station_id.begin(), blue_station_id.end());
-    assembleBlueLine(blue_station_id, tempLinkMapping, false);
+    // one collective gives every rank both its offset (the slices before it) and the length of the whole line
+    long long length = out - slice;
+    vector<long long> sliceLengths(nprocs);
+    MPI_Allgather(&length, 1, MPI_LONG_LONG, sliceLengths.data(), 1, MPI_LONG_LONG, MPI_COMM_WORLD);
+    long long offset = 0;
+    long long written = 0;
+    for (int r = 0; r < nprocs; r++) {
+        offset += r < myid ? sliceLengths[r] : 0;
+        written += sliceLengths[r];
+    }
+    MPI_File_write_at_all(outputFile, outputOffset + offset, slice, static_cast<int>(length), MPI_CHAR,
+                          MPI_STATUS_IGNORE);
+    outputOffset += written;
 }
 
-void assembleGreenLine(const vector<size_t> &green_station_id, map<pair<size_t, size_t>, size_t> &tempLinkMapping,
-                       bool isReverse) {
-    size_t currentLink, nextLink, nextTwoStation;
-    for (size_t i = 0; i < green_station_id.size() - 1; i++) {
-        size_t currentStation = green_station_id[i];
-        size_t nextStation = green_station_id[i + 1];
-        currentLink = tempLinkMapping[std::make_pair(currentStation, nextStation)];
-
-        if (i == green_station_id.size() - 2) { // terminal
-            nextLink = tempLinkMapping[std::make_pair(nextStation, currentStation)];
-            if (isReverse) {
-                terminalGreenForward = nextLink;
-            } else {
-                terminalGreenReverse = nextLink;
-            }
-        } else {
-            nextTwoStation = green_station_id[i + 2];
-            nextLink = tempLinkMapping[std::make_pair(nextStation, nextTwoStation)];
+void buildOutputFragments() {
+    fragmentText.clear();
+    fragmentOffset.assign(1, 0);
+    size_t maxFragmentLength = 0;
+    for (const staticLinkState &s: graphState) {
+        const string &source = stationIdNameMapping[s.srcId];
+        const string &destination = stationIdNameMapping[s.destId];
+        string fragments[3];
+        fragments[WAITING_AREA] = source + "# ";
+        fragments[PLATFORM] = source + "% ";
+        fragments[LINK] = source + "->" + destination + " ";
+        for (const string &fragment: fragments) {
+            fragmentText.insert(fragmentText.end(), fragment.begin(), fragment.end());
+            fragmentOffset.push_back(static_cast<uint32_t>(fragmentText.size()));
+            maxFragmentLength = max(maxFragmentLength, fragment.size());
         }
-
-        graphState[currentLink].nextLinkGreen = nextLink;
     }
+
+    // line character, id, '-' and the location
+    maxDescriptionLength = 1 + 20 + 1 + maxFragmentLength;
 }
 
-void assembleYellowLine(const vector<size_t> &yellow_station_id, map<pair<size_t, size_t>, size_t> &tempLinkMapping,
-                        bool isReverse) {
-    size_t currentLink, nextLink, nextTwoStation;
-    for (size_t i = 0; i < yellow_station_id.size() - 1; i++) {
-        size_t currentStation = yellow_station_id[i];
-        size_t nextStation = yellow_station_id[i + 1];
-        currentLink = tempLinkMapping[std::make_pair(currentStation, nextStation)];
-
-        if (i == yellow_station_id.size() - 2) { // terminal
-            nextLink = tempLinkMapping[std::make_pair(nextStation, currentStation)];
-            if (isReverse) {
-                terminalYellowForward = nextLink;
-            } else {
-                terminalYellowReverse = nextLink;
-            }
-        } else {
-            nextTwoStation = yellow_station_id[i + 2];
-            nextLink = tempLinkMapping[std::make_pair(nextStation, nextTwoStation)];
-        }
+// Same text as generateTroonDescription, written to out without building any string, returns the end of it. out needs
+// room for maxDescriptionLength characters.
+char *formatTroon(char *out, const Troon &t) {
+    static const char lineCharacters[] = {'g', 'y', 'b'}; // indexed by GREEN, YELLOW, BLUE
 
-        graphState[currentLink].nextLinkYellow = nextLink;
-    }
-}
+    *out++ = lineCharacters[t.line];
+    out = std::to_chars(out, out + 20, t.id).ptr;
+    *out++ = '-';
 
-void assembleBlueLine(const vector<size_t> &blue_station_id, map<pair<size_t, size_t>, size_t> &tempLinkMapping,
-                      bool isReverse) {
-    size_t currentLink, nextLink, nextTwoStation;
-    for (size_t i = 0; i < blue_station_id.size() - 1; i++) {
-        size_t currentStation = blue_station_id[i];
-        size_t nextStation = blue_station_id[i + 1];
-        currentLink = tempLinkMapping[std::make_pair(currentStation, nextStation)];
-
-        if (i == blue_station_id.size() - 2) { // terminal
-            nextLink = tempLinkMapping[std::make_pair(nextStation, currentStation)];
-            if (isReverse) {
-                terminalBlueForward = nextLink;
-            } else {
-                terminalBlueReverse = nextLink;
-            }
-        } else {
-            nextTwoStation = blue_station_id[i + 2];
-            nextLink = tempLinkMapping[std::make_pair(nextStation, nextTwoStation)];
-        }
+    size_t fragment = 3 * t.currentLink + t.location;
+    uint32_t length = fragmentOffset[fragment + 1] - fragmentOffset[fragment];
+    memcpy(out, &fragmentText[fragmentOffset[fragment]], length);
+    return out + length;
+}
 
-        graphState[currentLink].nextLinkBlue = nextLink;
+// Grows outputBuffer so that troons descriptions, a tick prefix and a newline fit after its first used bytes.
+char *reserveOutput(size_t used, size_t troons) {
+    size_t needed = used + 20 + 2 + troons * maxDescriptionLength + 1;
+    if (outputBuffer.size() < needed) {
+        outputBuffer.resize(needed);
     }
+    return outputBuffer.data() + used;
 }
 
-void populateStaticData(
-        const vector<size_t> &popularities,
-        const adjacency_matrix &mat,
-        const vector<size_t> &station_id,
-        map<pair<size_t, size_t>, size_t> &tempLinkMapping
-) {
-    for (size_t i = 0; i < station_id.size() - 1; i++) {
-        size_t currentStation = station_id[i];
-        size_t nextStation = station_id[i + 1];
-
-        if (tempLinkMapping.find(std::make_pair(currentStation, nextStation)) == tempLinkMapping.end()) {
-            staticLinkState s = {};
-            s.popularity = popularities[currentStation];
-            s.srcId = currentStation;
-            s.destId = nextStation;
-            s.distance = mat[currentStation][nextStation];
-            s.id = graphCounter++;
+// Troons per microsecond of generateTroonDescription and formatTroon on BENCH_FORMAT_TROONS troons spread over the
+// links, all locations and lines.
+void runFormatBenchmark() {
+    if (myid != ORIGINAL_PROC) return;
+
+    const int iterations = 50;
+    vector<Troon> troons(BENCH_FORMAT_TROONS);
+    for (size_t i = 0; i < troons.size(); i++) {
+        size_t link = i * 7919 % graphState.size();
+        troons[i].id = i * 104729 % 1000000;
+        troons[i].line = i % 3;
+        troons[i].location = i / 3 % 3;
+        troons[i].currentLink = link;
+        troons[i].src = graphState[link].srcId;
+        troons[i].dest = graphState[link].destId;
+    }
 
-            tempLinkMapping[std::make_pair(currentStation, nextStation)] = s.id;
-            graphState.push_back(s);
+    string expected;
+    double start = MPI_Wtime();
+    for (int r = 0; r < iterations; r++) {
+        stringstream ss;
+        for (const Troon &troon: troons) {
+            ss << generateTroonDescription(troon);
         }
+        expected = ss.str();
     }
-}
+    double stringElapsed = MPI_Wtime() - start;
+
+    char *line = nullptr;
+    char *out = nullptr;
+    start = MPI_Wtime();
+    for (int r = 0; r < iterations; r++) {
+        line = reserveOutput(0, troons.size());
+        out = line;
+        for (const Troon &troon: troons) {
+            out = formatTroon(out, troon);
+        }
+    }
+    double formatElapsed = MPI_Wtime() - start;
 
-void convertStationNamesToId(const vector<string> &station_names, vector<size_t> &station_id) {
-    for (const auto &green_station_name: station_names) {
-        station_id.push_back(stationNameIdMapping[green_station_name]);
+    if (expected != string(line, out)) {
+        std::cerr << "formatTroon and generateTroonDescription disagree\n";
     }
+    double formatted = static_cast<double>(troons.size()) * iterations;
+    cout << "format generateTroonDescription, troons/us: " << formatted / (stringElapsed * 1e6) << endl;
+    cout << "format formatTroon, troons/us: " << formatted / (formatElapsed * 1e6) << endl;
 }
 
 string generateTroonDescription(const Troon &t) {
@@ -847,90 +3308,589 @@ string generateTroonDescription(const Troon &t) {
     return currentLine + std::to_string(t.id) + "-" + currentLocation;
 }
 
-vector<string> extract_station_names(string &line) {
-    constexpr char space_delimiter = ' ';
-    vector<string> stations{};
-    line += ' ';
-    size_t pos;
-    while ((pos = line.find(space_delimiter)) != string::npos) {
-        stations.push_back(line.substr(0, pos));
-        line.erase(0, pos + 1);
+uint64_t computeTroonSortKey(size_t id, size_t line) {
+    uint64_t lineRank;
+    switch (line) { // same order as the line characters 'b' < 'g' < 'y'
+        case BLUE:
+            lineRank = 0;
+            break;
+        case GREEN:
+            lineRank = 1;
+            break;
+        default:
+            lineRank = 2;
+    }
+
+    uint64_t scaled = id;
+    uint64_t digits = 1;
+    for (uint64_t v = id; v >= 10; v /= 10) {
+        digits++;
+    }
+    for (uint64_t d = digits; d < SORT_KEY_DIGITS; d++) {
+        scaled *= 10;
+    }
+
+    // scaled < 10^16 and digits <= 16, so the low part stays below 2^62
+    return (lineRank << 62) | (scaled * (SORT_KEY_DIGITS + 1) + digits);
+}
+
+// The input is mapped into memory and scanned in place. The S x S distance matrix dominates the file, but the lines
+// only use a few of its entries, so the first pass just records where every row starts and the distances of the line
+// edges are parsed afterwards.
+bool isInputSpace(char c) {
+    return static_cast<unsigned char>(c) <= ' ';
+}
+
+const char *skipInputSpaces(const char *pos, const char *end) {
+    while (pos < end && isInputSpace(*pos)) {
+        pos++;
     }
-    return stations;
+    return pos;
+}
+
+const char *skipInputToken(const char *pos, const char *end) {
+    while (pos < end && !isInputSpace(*pos)) {
+        pos++;
+    }
+    return pos;
+}
+
+// Returns the start of the k-th token (0-based) after pos, which has to be on a token start or a separator.
+const char *findInputToken(const char *pos, const char *end, size_t k) {
+    bool isPreviousSpace = true;
+#ifdef __SSE2__
+    const __m128i space = _mm_set1_epi8(' ');
+    unsigned carry = 0; // whether the byte before the chunk is part of a token
+    while (end - pos >= 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pos));
+        // bytes above 0x7f compare as negative and count as separators, they never appear in the matrix
+        unsigned isToken = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpgt_epi8(chunk, space)));
+        unsigned starts = isToken & ~((isToken << 1) | carry) & 0xffffU;
+        size_t count = static_cast<size_t>(__builtin_popcount(starts));
+        if (count > k) {
+            for (; k > 0; k--) {
+                starts &= starts - 1;
+            }
+            return pos + __builtin_ctz(starts);
+        }
+        k -= count;
+        carry = (isToken >> 15) & 1U;
+        pos += 16;
+    }
+    isPreviousSpace = carry == 0;
+#endif
+    for (; pos < end; pos++) {
+        bool isSpace = isInputSpace(*pos);
+        if (!isSpace && isPreviousSpace) {
+            if (k == 0) {
+                return pos;
+            }
+            k--;
+        }
+        isPreviousSpace = isSpace;
+    }
+    return end;
+}
+
+[[noreturn]] void failInput(const char *path, const string &reason) {
+    std::cerr << "Malformed input " << path << ": " << reason << '\n';
+    MPI_Abort(MPI_COMM_WORLD, 2);
+    std::exit(2); // MPI_Abort does not return
+}
+
+size_t parseInputNumber(const char *&pos, const char *end, const char *path) {
+    pos = skipInputSpaces(pos, end);
+    size_t value = 0;
+    auto result = std::from_chars(pos, end, value);
+    if (result.ec != std::errc() || (result.ptr < end && !isInputSpace(*result.ptr))) {
+        failInput(path, "expected a number");
+    }
+    pos = result.ptr;
+    return value;
+}
+
+string parseInputName(const char *&pos, const char *end, const char *path) {
+    pos = skipInputSpaces(pos, end);
+    const char *tokenEnd = skipInputToken(pos, end);
+    if (tokenEnd == pos) {
+        failInput(path, "expected a station name");
+    }
+    string name(pos, tokenEnd);
+    pos = tokenEnd;
+    return name;
+}
+
+// Reads the space separated names up to the end of the current text line.
+vector<string> parseInputLine(const char *&pos, const char *end) {
+    vector<string> names;
+    while (pos < end && *pos != '\n') {
+        if (isInputSpace(*pos)) {
+            pos++;
+            continue;
+        }
+        const char *tokenEnd = skipInputToken(pos, end);
+        names.emplace_back(pos, tokenEnd);
+        pos = tokenEnd;
+    }
+    if (pos < end) {
+        pos++;
+    }
+    return names;
+}
+
+vector<size_t> resolveLineStations(const vector<string> &names, const StationNameTable &stations, const char *path) {
+    vector<size_t> ids;
+    ids.reserve(names.size());
+    for (const string &name: names) {
+        size_t id = findStation(stations, name);
+        if (id == EMPTY_SLOT) {
+            failInput(path, "unknown station " + name + " on a line");
+        }
+        ids.push_back(id);
+    }
+    return ids;
+}
+
+void appendLineEdges(const vector<size_t> &station_ids, line_edges &edges) {
+    for (size_t i = 0; i + 1 < station_ids.size(); i++) {
+        edges.push_back({station_ids[i], station_ids[i + 1], 0});
+        edges.push_back({station_ids[i + 1], station_ids[i], 0});
+    }
+}
+
+size_t lineEdgeDistance(const line_edges &edges, size_t src, size_t dest) {
+    auto it = std::lower_bound(edges.begin(), edges.end(), LineEdge{src, dest, 0},
+                               [](const LineEdge &a, const LineEdge &b) {
+                                   return a.src < b.src || (a.src == b.src && a.dest < b.dest);
+                               });
+    return it->distance;
+}
+
+// A compiled network stays mapped until the links are broadcast, the link records are used in place.
+void loadSnapshot(const char *path, void *mapping, size_t length, NetworkInput &input) {
+    const auto *header = static_cast<const SnapshotHeader *>(mapping);
+    if (header->version != SNAPSHOT_VERSION || header->linkRecordSize != sizeof(LinkRecord)) {
+        failInput(path, "compiled by an incompatible version");
+    }
+    size_t linksEnd = sizeof(SnapshotHeader) + header->numLinks * sizeof(LinkRecord);
+    if (header->numLinks >= MAX_LINKS || length < linksEnd || length - linksEnd != header->namesSize) {
+        failInput(path, "truncated snapshot");
+    }
+
+    input.snapshot_mapping = mapping;
+    input.snapshot_length = length;
+    input.num_stations = header->numStations;
+    input.ticks = header->ticks;
+    input.num_green_trains = header->numGreenTrains;
+    input.num_yellow_trains = header->numYellowTrains;
+    input.num_blue_trains = header->numBlueTrains;
+    input.num_lines = header->numLines;
+    input.num_links = header->numLinks;
+    input.link_records = reinterpret_cast<const LinkRecord *>(static_cast<const char *>(mapping) +
+                                                              sizeof(SnapshotHeader));
+
+    terminalGreenForward = header->terminals[0];
+    terminalGreenReverse = header->terminals[1];
+    terminalYellowForward = header->terminals[2];
+    terminalYellowReverse = header->terminals[3];
+    terminalBlueForward = header->terminals[4];
+    terminalBlueReverse = header->terminals[5];
+
+    // the links index graphState and stationIdNameMapping directly, a damaged file must not send them out of range
+    for (uint64_t terminal: header->terminals) {
+        if (terminal >= header->numLinks) {
+            failInput(path, "terminal link out of range");
+        }
+    }
+    for (size_t l = 0; l < header->numLinks; l++) {
+        const LinkRecord &r = input.link_records[l];
+        if (r.nextLinkGreen >= header->numLinks || r.nextLinkYellow >= header->numLinks ||
+            r.nextLinkBlue >= header->numLinks) {
+            failInput(path, "next link out of range");
+        }
+        if (r.srcId >= header->numStations || r.destId >= header->numStations) {
+            failInput(path, "station out of range");
+        }
+    }
+
+    const char *name = static_cast<const char *>(mapping) + linksEnd;
+    const char *namesEnd = name + header->namesSize;
+    stationIdNameMapping.reserve(header->numStations);
+    while (name < namesEnd) {
+        const char *nameEnd = static_cast<const char *>(memchr(name, '\0', namesEnd - name));
+        if (nameEnd == nullptr) {
+            failInput(path, "truncated station names");
+        }
+        stationIdNameMapping.emplace_back(name, nameEnd);
+        name = nameEnd + 1;
+    }
+    if (stationIdNameMapping.size() != header->numStations) {
+        failInput(path, "wrong number of station names");
+    }
+}
+
+// Copies the links assembled by initialization into the records that are broadcast and compiled.
+void packLinkRecords(NetworkInput &input) {
+    input.link_storage.clear();
+    input.link_storage.reserve(graphState.size());
+    for (const staticLinkState &s: graphState) {
+        input.link_storage.push_back({s.popularity, s.distance, static_cast<uint32_t>(s.nextLinkGreen),
+                                      static_cast<uint32_t>(s.nextLinkYellow), static_cast<uint32_t>(s.nextLinkBlue),
+                                      static_cast<uint32_t>(s.srcId), static_cast<uint32_t>(s.destId), 0});
+    }
+    input.link_records = input.link_storage.data();
+    input.num_links = input.link_storage.size();
+}
+
+void writeSnapshot(const char *path, const NetworkInput &input) {
+    string names;
+    for (auto &name: stationIdNameMapping) {
+        names += name;
+        names += '\0';
+    }
+
+    SnapshotHeader header = {};
+    memcpy(header.magic, SNAPSHOT_MAGIC, 8);
+    header.version = SNAPSHOT_VERSION;
+    header.linkRecordSize = sizeof(LinkRecord);
+    header.numStations = input.num_stations;
+    header.numLinks = input.num_links;
+    header.namesSize = names.size();
+    header.ticks = input.ticks;
+    header.numGreenTrains = input.num_green_trains;
+    header.numYellowTrains = input.num_yellow_trains;
+    header.numBlueTrains = input.num_blue_trains;
+    header.numLines = input.num_lines;
+    header.terminals[0] = terminalGreenForward;
+    header.terminals[1] = terminalGreenReverse;
+    header.terminals[2] = terminalYellowForward;
+    header.terminals[3] = terminalYellowReverse;
+    header.terminals[4] = terminalBlueForward;
+    header.terminals[5] = terminalBlueReverse;
+
+    std::ofstream ofs(path, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+    ofs.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    ofs.write(reinterpret_cast<const char *>(input.link_records),
+              static_cast<std::streamsize>(input.num_links * sizeof(LinkRecord)));
+    ofs.write(names.data(), static_cast<std::streamsize>(names.size()));
+    ofs.close();
+    if (!ofs) {
+        std::cerr << "Failed to write " << path << '\n';
+        MPI_Abort(MPI_COMM_WORLD, 2);
+    }
+}
+
+void releaseInput(NetworkInput &input) {
+    if (input.snapshot_mapping != nullptr) {
+        munmap(input.snapshot_mapping, input.snapshot_length);
+        input.snapshot_mapping = nullptr;
+    }
+    input.link_records = nullptr;
+    input.link_storage = vector<LinkRecord>();
+}
+
+void loadInput(const char *path, NetworkInput &input) {
+    int fd = open(path, O_RDONLY);
+    struct stat info = {};
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        std::cerr << "Failed to open " << path << '\n';
+        MPI_Abort(MPI_COMM_WORLD, 2);
+    }
+    size_t length = static_cast<size_t>(info.st_size);
+    if (length == 0) {
+        failInput(path, "empty file");
+    }
+    void *mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        std::cerr << "Failed to map " << path << '\n';
+        MPI_Abort(MPI_COMM_WORLD, 2);
+    }
+
+    if (length >= sizeof(SnapshotHeader) && memcmp(mapping, SNAPSHOT_MAGIC, 8) == 0) {
+        loadSnapshot(path, mapping, length, input);
+        return;
+    }
+    madvise(mapping, length, MADV_SEQUENTIAL);
+
+    const char *pos = static_cast<const char *>(mapping);
+    const char *end = pos + length;
+
+    size_t S = parseInputNumber(pos, end, path);
+    if (S >= UINT32_MAX) { // station ids are sent as 32 bits
+        failInput(path, "too many stations");
+    }
+    input.num_stations = S;
+
+    input.station_names.reserve(S);
+    for (size_t i = 0; i < S; i++) {
+        input.station_names.push_back(parseInputName(pos, end, path));
+    }
+
+    input.popularities.reserve(S);
+    for (size_t i = 0; i < S; i++) {
+        input.popularities.push_back(parseInputNumber(pos, end, path));
+    }
+
+    // Only remember where each matrix row starts, S tokens after the previous one.
+    vector<const char *> rowStart(S);
+    for (size_t i = 0; i < S; i++) {
+        rowStart[i] = findInputToken(i == 0 ? pos : rowStart[i - 1], end, i == 0 ? 0 : S);
+    }
+    if (S > 0) {
+        pos = findInputToken(rowStart[S - 1], end, S - 1);
+        if (pos == end) {
+            failInput(path, "truncated distance matrix");
+        }
+        pos = skipInputToken(pos, end);
+    }
+    while (pos < end && *pos != '\n') {
+        pos++;
+    }
+    if (pos < end) {
+        pos++;
+    }
+
+    StationNameTable stations;
+    buildStationNameTable(input.station_names, stations);
+    input.green_station_ids = resolveLineStations(parseInputLine(pos, end), stations, path);
+    input.yellow_station_ids = resolveLineStations(parseInputLine(pos, end), stations, path);
+    input.blue_station_ids = resolveLineStations(parseInputLine(pos, end), stations, path);
+
+    input.ticks = parseInputNumber(pos, end, path);
+    input.num_green_trains = parseInputNumber(pos, end, path);
+    input.num_yellow_trains = parseInputNumber(pos, end, path);
+    input.num_blue_trains = parseInputNumber(pos, end, path);
+    input.num_lines = parseInputNumber(pos, end, path);
+
+    // Parse the distances the lines need, walking each row left to right.
+    line_edges &edges = input.edges;
+    appendLineEdges(input.green_station_ids, edges);
+    appendLineEdges(input.yellow_station_ids, edges);
+    appendLineEdges(input.blue_station_ids, edges);
+    std::sort(edges.begin(), edges.end(), [](const LineEdge &a, const LineEdge &b) {
+        return a.src < b.src || (a.src == b.src && a.dest < b.dest);
+    });
+    edges.erase(std::unique(edges.begin(), edges.end(), [](const LineEdge &a, const LineEdge &b) {
+        return a.src == b.src && a.dest == b.dest;
+    }), edges.end());
+
+    for (size_t i = 0; i < edges.size(); i++) {
+        if (i == 0 || edges[i].src != edges[i - 1].src) {
+            pos = findInputToken(rowStart[edges[i].src], end, edges[i].dest);
+        } else {
+            // pos is just past the previous distance of this row
+            pos = findInputToken(pos, end, edges[i].dest - edges[i - 1].dest - 1);
+        }
+        edges[i].distance = parseInputNumber(pos, end, path);
+    }
+
+    munmap(mapping, length);
+}
+
+// Parses --<name>=<count>, returns false if option is not that option.
+bool parseCountOption(const string &option, const string &prefix, size_t &value) {
+    if (option.rfind(prefix, 0) != 0) {
+        return false;
+    }
+    const char *first = option.data() + prefix.size();
+    const char *last = option.data() + option.size();
+    auto result = std::from_chars(first, last, value);
+    if (result.ec != std::errc() || result.ptr != last) {
+        std::cerr << "Invalid value in " << option << '\n';
+        std::exit(1);
+    }
+    return true;
 }
 
 int main(int argc, char **argv) {
     using std::cout;
 
-    if (argc < 2) {
-        std::cerr << argv[0] << " <input_file>\n";
+    // troons --compile <input_file> <output_file> assembles the network once and writes it as a snapshot that can be
+    // passed as the input file of later runs
+    bool isCompiling = argc >= 2 && string(argv[1]) == "--compile";
+    int firstOption = isCompiling ? 4 : 2;
+
+    if (argc < firstOption) {
+        std::cerr << argv[0] << " <input_file> [--engine=sweep|event] [--fast-forward] [--partition=chain|block]"
+                     " [--lookahead] [--overlap] [--kernels=auto|scalar|avx2|avx512] [--threads=N]"
+                     " [--rebalance=N] [--rebalance-threshold=P] [--output=FILE] [--writer=thread|inline]"
+                     " [--trajectory=FILE] [--profile] [--bench=tick|kernels|format]"
+                     " [--ticks=N] [--green-trains=N] [--yellow-trains=N] [--blue-trains=N] [--lines=N]\n"
+                  << argv[0] << " --compile <input_file> <output_file>\n";
+        std::exit(1);
+    }
+    const char *inputPath = isCompiling ? argv[2] : argv[1];
+
+    string kernels = "auto";
+    size_t ticksOverride = SIZE_MAX;
+    size_t greenTrainsOverride = SIZE_MAX;
+    size_t yellowTrainsOverride = SIZE_MAX;
+    size_t blueTrainsOverride = SIZE_MAX;
+    size_t linesOverride = SIZE_MAX;
+    size_t threads = 1;
+
+    for (int i = firstOption; i < argc; i++) {
+        string option = argv[i];
+        if (option == "--engine=sweep") {
+            useEventEngine = false;
+        } else if (option == "--engine=event") {
+            useEventEngine = true;
+        } else if (option == "--fast-forward") {
+            useFastForward = true;
+        } else if (option == "--partition=chain") {
+            useBlockPartition = false;
+        } else if (option == "--partition=block") {
+            useBlockPartition = true;
+        } else if (option == "--lookahead") {
+            useLookahead = true;
+        } else if (option == "--overlap") {
+            useOverlap = true;
+        } else if (option.rfind("--bench=", 0) == 0) {
+            benchmark = option.substr(8);
+        } else if (option == "--profile") {
+            useProfile = true;
+        } else if (option == "--writer=thread") {
+            useWriterThread = true;
+        } else if (option == "--writer=inline") {
+            useWriterThread = false;
+        } else if (option.rfind("--trajectory=", 0) == 0) {
+            trajectoryPath = option.substr(13);
+        } else if (option.rfind("--output=", 0) == 0) {
+            outputPath = option.substr(9);
+        } else if (option.rfind("--kernels=", 0) == 0) {
+            kernels = option.substr(10);
+        } else if (parseCountOption(option, "--ticks=", ticksOverride) ||
+                   parseCountOption(option, "--green-trains=", greenTrainsOverride) ||
+                   parseCountOption(option, "--yellow-trains=", yellowTrainsOverride) ||
+                   parseCountOption(option, "--blue-trains=", blueTrainsOverride) ||
+                   parseCountOption(option, "--lines=", linesOverride) ||
+                   parseCountOption(option, "--threads=", threads) ||
+                   parseCountOption(option, "--rebalance=", rebalanceInterval) ||
+                   parseCountOption(option, "--rebalance-threshold=", rebalanceThreshold)) {
+            continue;
+        } else {
+            std::cerr << "Unknown option " << option << '\n';
+            std::exit(1);
+        }
+    }
+
+    if (!benchmark.empty() && benchmark != "tick" && benchmark != "kernels" && benchmark != "format") {
+        std::cerr << "Unknown benchmark " << benchmark << '\n';
         std::exit(1);
     }
 
-    std::ifstream ifs(argv[1], std::ios_base::in);
-    if (!ifs.is_open()) {
-        std::cerr << "Failed to open " << argv[1] << '\n';
-        std::exit(2);
+    if (!selectSweepKernels(kernels)) {
+        std::cerr << "Kernels " << kernels << " are not supported on this machine\n";
+        std::exit(1);
+    }
+
+    if (useOverlap && useLookahead) {
+        std::cerr << "--overlap exchanges every tick and cannot be combined with --lookahead\n";
+        std::exit(1);
     }
 
-    // Read S
-    size_t S;
-    ifs >> S;
+    if (!outputPath.empty() && !trajectoryPath.empty()) {
+        std::cerr << "--output and --trajectory both replace the text output, pick one\n";
+        std::exit(1);
+    }
 
-    // Read station names.
-    string station;
-    std::vector<string> station_names{};
-    station_names.reserve(S);
-    for (size_t i = 0; i < S; ++i) {
-        ifs >> station;
-        station_names.emplace_back(station);
+    // announced troons and posted receives are tied to the partition they were made for
+    if (rebalanceInterval > 0 && (useLookahead || useOverlap || useEventEngine)) {
+        std::cerr << "--rebalance needs the sweep engine without --lookahead and --overlap\n";
+        std::exit(1);
     }
 
-    // Read P popularity
-    size_t p;
-    std::vector<size_t> popularities{};
-    popularities.reserve(S);
-    for (size_t i = 0; i < S; ++i) {
-        ifs >> p;
-        popularities.emplace_back(p);
+#ifdef _OPENMP
+    if (threads == 0 || threads > INT_MAX) {
+        std::cerr << "--threads must be at least 1\n";
+        std::exit(1);
     }
+#else
+    if (threads != 1) {
+        std::cerr << "--threads needs a build with OpenMP\n";
+        std::exit(1);
+    }
+#endif
+    numThreads = static_cast<int>(threads);
 
-    // Form adjacency mat
-    adjacency_matrix mat(S, std::vector<size_t>(S));
-    for (size_t src{}; src < S; ++src) {
-        for (size_t dst{}; dst < S; ++dst) {
-            ifs >> mat[src][dst];
+    // only the main thread calls MPI, the threads never leave the sweep phases
+    int threadSupport;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &threadSupport);
+    MPI_Comm_size(MPI_COMM_WORLD, &nprocs);
+    MPI_Comm_rank(MPI_COMM_WORLD, &myid);
+    if (threadSupport < MPI_THREAD_FUNNELED) {
+        // the MPI library only allows the thread that called MPI_Init_thread, run without the extra threads
+        if (myid == ORIGINAL_PROC && (numThreads > 1 || useWriterThread)) {
+            std::cerr << "MPI does not support MPI_THREAD_FUNNELED, running with --threads=1 --writer=inline\n";
         }
+        numThreads = 1;
+        useWriterThread = false;
     }
 
-    ifs.ignore();
+    // Only rank 0 reads the file, the other ranks get the assembled links from broadcastTopology.
+    NetworkInput input;
+    if (myid == ORIGINAL_PROC) {
+        loadInput(inputPath, input);
+        if (input.link_records == nullptr) { // text input, a snapshot is already assembled
+            initialization(input.station_names, input.popularities, input.green_station_ids,
+                           input.yellow_station_ids, input.blue_station_ids, input.edges);
+            packLinkRecords(input);
+        }
 
-    string stations_buf;
+        if (ticksOverride != SIZE_MAX) {
+            input.ticks = ticksOverride;
+        }
+        if (greenTrainsOverride != SIZE_MAX) {
+            input.num_green_trains = greenTrainsOverride;
+        }
+        if (yellowTrainsOverride != SIZE_MAX) {
+            input.num_yellow_trains = yellowTrainsOverride;
+        }
+        if (blueTrainsOverride != SIZE_MAX) {
+            input.num_blue_trains = blueTrainsOverride;
+        }
+        if (linesOverride != SIZE_MAX) {
+            input.num_lines = linesOverride;
+        }
 
-    std::getline(ifs, stations_buf);
-    auto green_station_names = extract_station_names(stations_buf);
+        if (input.num_green_trains + input.num_yellow_trains + input.num_blue_trains >= NO_TROON) {
+            // ids stay below 2^32, well within the SORT_KEY_DIGITS digits of computeTroonSortKey
+            std::cerr << "At most " << NO_TROON - 1 << " troons are supported\n";
+            MPI_Abort(MPI_COMM_WORLD, 3);
+        }
 
-    std::getline(ifs, stations_buf);
-    auto yellow_station_names = extract_station_names(stations_buf);
+        if (input.num_links >= MAX_LINKS) {
+            std::cerr << "At most " << MAX_LINKS - 1 << " links are supported\n";
+            MPI_Abort(MPI_COMM_WORLD, 3);
+        }
 
-    std::getline(ifs, stations_buf);
-    auto blue_station_names = extract_station_names(stations_buf);
+        if (isCompiling) {
+            writeSnapshot(argv[3], input);
+        }
+    }
 
-    // N time ticks
-    size_t N;
-    ifs >> N;
+    if (isCompiling) {
+        MPI_Finalize();
+        return 0;
+    }
 
-    // g,y,b number of trains per line
-    size_t g, y, b;
-    ifs >> g;
-    ifs >> y;
-    ifs >> b;
+    broadcastTopology(input);
+    releaseInput(input);
 
-    size_t num_lines;
-    ifs >> num_lines;
+#ifdef DEBUG
+    if (myid == ORIGINAL_PROC) {
+        for (auto &c: graphState) {
+            cout << c.id << " " << c.srcId << " " << c.destId << " Y : " << c.nextLinkYellow << " G : "
+                 << c.nextLinkGreen << "  B : " << c.nextLinkBlue << " Distance: " << c.distance << endl;
+        }
+        cout << terminalGreenForward << " " << terminalGreenReverse << endl;
+        cout << terminalYellowForward << " " << terminalYellowReverse << endl;
+        cout << terminalBlueForward << " " << terminalBlueReverse << endl;
+    }
+#endif
 
-    simulate(S, station_names, popularities, mat, green_station_names,
-             yellow_station_names, blue_station_names, N, g, y, b, num_lines, argc, argv);
+    simulate(input.ticks, input.num_green_trains, input.num_yellow_trains, input.num_blue_trains, input.num_lines);
 
     return 0;
 }